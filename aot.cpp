@@ -0,0 +1,344 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "aot.hpp"
+#include "selftest.hpp"
+#include "vm.hpp"
+
+// Everything the generated code needs, so that it builds with nothing but
+// the C++ standard library. Value mirrors the interpreter's semantics,
+// not its layout.
+static const char *const prelude = R"(#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+enum Type { TYPE_NULL, TYPE_BOOL, TYPE_NUMBER };
+
+struct Value {
+    Type type;
+    bool boolean;
+    double number;
+};
+
+static inline Value nullValue() { return Value{TYPE_NULL, false, 0}; }
+static inline Value boolValue(bool b) { return Value{TYPE_BOOL, b, 0}; }
+static inline Value numberValue(double n) { return Value{TYPE_NUMBER, false, n}; }
+
+static inline Value numberBits(uint64_t bits) {
+    double n;
+    memcpy(&n, &bits, sizeof(n));
+    return numberValue(n);
+}
+
+static inline bool isNumber(Value v) { return v.type == TYPE_NUMBER; }
+static inline bool isFalsey(Value v) { return v.type == TYPE_NULL || (v.type == TYPE_BOOL && !v.boolean); }
+
+static inline bool valuesEqual(Value a, Value b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case TYPE_BOOL:   return a.boolean == b.boolean;
+        case TYPE_NULL:   return true;
+        case TYPE_NUMBER: return a.number == b.number;
+    }
+    return false;
+}
+
+[[noreturn]] static inline void runtimeError(const char* message, int line) {
+    fprintf(stderr, "%s\n[line %d] in script\n", message, line);
+    exit(70);
+}
+
+// $index is read from the command line: the program's first argument is $0
+static inline Value column(int argc, char** argv, int index, int line) {
+    if (index + 1 >= argc) {
+        char message[64];
+        snprintf(message, sizeof(message), "Column $%d is not bound.", index);
+        runtimeError(message, line);
+    }
+    return numberValue(strtod(argv[index + 1], nullptr));
+}
+
+static inline void printValue(Value v) {
+    if (v.type == TYPE_BOOL) printf("%s\n", v.boolean ? "true" : "false");
+    else if (v.type == TYPE_NULL) printf("null\n");
+    else printf("%g\n", v.number);
+}
+
+)";
+
+// Hex float literals round-trip exactly; infinities and NaNs (which
+// folding can produce) are spelled out as their bit pattern instead.
+static void emitNumber(FILE *out, double number)
+{
+    if (std::isfinite(number))
+    {
+        fprintf(out, "numberValue(%a)", number);
+        return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    fprintf(out, "numberBits(0x%016llxULL)", (unsigned long long)bits);
+}
+
+static void emitLiteral(FILE *out, int slot, Value value)
+{
+    fprintf(out, "    s[%d] = ", slot);
+    if (IS_NULL(value))
+        fprintf(out, "nullValue()");
+    else if (IS_BOOL(value))
+        fprintf(out, "boolValue(%s)", AS_BOOL(value) ? "true" : "false");
+    else
+        emitNumber(out, AS_NUMBER(value));
+    fprintf(out, ";\n");
+}
+
+static void emitCheck(FILE *out, int a, int b, int line)
+{
+    fprintf(out, "    if (!isNumber(s[%d]) || !isNumber(s[%d])) runtimeError(\"Operands must be numbers.\", %d);\n",
+            a, b, line);
+}
+
+// Writes one binary operator on s[a] and s[a + 1] into s[a].
+static void emitBinary(FILE *out, int a, const char *format)
+{
+    fprintf(out, "    s[%d] = ", a);
+    fprintf(out, format, a, a + 1);
+    fprintf(out, ";\n");
+}
+
+static bool isUnchecked(uint8_t op)
+{
+    return op >= OP_NEGATE_UNCHECKED && op <= OP_LESS_EQUAL_UNCHECKED;
+}
+
+// expression for an operator that requires two numbers, given the two
+// slot indices
+static const char *numericFormat(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD:           return "numberValue(s[%d].number + s[%d].number)";
+    case OP_SUBTRACT:      return "numberValue(s[%d].number - s[%d].number)";
+    case OP_MULTIPLY:      return "numberValue(s[%d].number * s[%d].number)";
+    case OP_DIVIDE:        return "numberValue(s[%d].number / s[%d].number)";
+    case OP_MODULO:        return "numberValue(fmod(s[%d].number, s[%d].number))";
+    case OP_POWER:         return "numberValue(pow(s[%d].number, s[%d].number))";
+    case OP_GREATER:       return "boolValue(s[%d].number > s[%d].number)";
+    case OP_GREATER_EQUAL: return "boolValue(s[%d].number >= s[%d].number)";
+    case OP_LESS:          return "boolValue(s[%d].number < s[%d].number)";
+    default:               return "boolValue(s[%d].number <= s[%d].number)";
+    }
+}
+
+bool emitCpp(const Chunk *chunk, const char *name, FILE *out)
+{
+    fprintf(out, "// Generated by Ioapp --emit-cpp from %s\n", name);
+    fputs(prelude, out);
+    fprintf(out, "int main(int argc, char** argv) {\n");
+    fprintf(out, "    (void)argc;\n    (void)argv;\n");
+
+    // execute() refuses these before running a single instruction
+    if (chunk->maxStack < 0 || chunk->maxStack > STACK_MAX)
+    {
+        fprintf(out, "    fprintf(stderr, \"Stack overflow: expression needs %d slots, the limit is %d.\\n\");\n",
+                chunk->maxStack, STACK_MAX);
+        fprintf(out, "    return 70;\n}\n");
+        return !ferror(out);
+    }
+
+    // The code is straight-line, so the stack depth at every instruction
+    // is known here and each stack slot becomes a fixed array element.
+    fprintf(out, "    Value s[%d];\n", chunk->maxStack > 0 ? chunk->maxStack : 1);
+    int depth = 0;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t op = chunk->code[offset];
+        const uint8_t *operand = chunk->code + offset + 1;
+        int line = getLine(chunk, offset);
+        int top = depth - 1;
+
+        switch (genericOpcode(op))
+        {
+        case OP_CONSTANT:
+            emitLiteral(out, depth++, chunk->constants.values[operand[0]]);
+            break;
+        case OP_CONSTANT_BIG:
+            emitLiteral(out, depth++, chunk->constants.values[(operand[0] << 16) | (operand[1] << 8) | operand[2]]);
+            break;
+        case OP_INT8:
+            emitLiteral(out, depth++, NUMBER_VAL((int8_t)operand[0]));
+            break;
+        case OP_INT16:
+            emitLiteral(out, depth++, NUMBER_VAL((int16_t)((operand[0] << 8) | operand[1])));
+            break;
+        case OP_FIXED16:
+            emitLiteral(out, depth++, NUMBER_VAL((int16_t)((operand[0] << 8) | operand[1]) / 256.0));
+            break;
+        case OP_NULL:
+            emitLiteral(out, depth++, NULL_VAL);
+            break;
+        case OP_TRUE:
+            emitLiteral(out, depth++, BOOL_VAL(true));
+            break;
+        case OP_FALSE:
+            emitLiteral(out, depth++, BOOL_VAL(false));
+            break;
+        case OP_COLUMN:
+            fprintf(out, "    s[%d] = column(argc, argv, %d, %d);\n", depth++, operand[0], line);
+            break;
+
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_POWER:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+            if (!isUnchecked(op))
+                emitCheck(out, top - 1, top, line);
+            emitBinary(out, top - 1, numericFormat(genericOpcode(op)));
+            depth--;
+            break;
+        case OP_EQUAL:
+            emitBinary(out, top - 1, "boolValue(valuesEqual(s[%d], s[%d]))");
+            depth--;
+            break;
+        case OP_NOT_EQUAL:
+            emitBinary(out, top - 1, "boolValue(!valuesEqual(s[%d], s[%d]))");
+            depth--;
+            break;
+        case OP_NOT:
+            fprintf(out, "    s[%d] = boolValue(isFalsey(s[%d]));\n", top, top);
+            break;
+        case OP_NEGATE:
+            if (!isUnchecked(op))
+                fprintf(out, "    if (!isNumber(s[%d])) runtimeError(\"Operand must be a number.\", %d);\n", top, line);
+            fprintf(out, "    s[%d] = numberValue(-s[%d].number);\n", top, top);
+            break;
+        case OP_RETURN:
+            fprintf(out, "    printValue(s[%d]);\n    return 0;\n}\n", top);
+            return !ferror(out);
+
+        default:
+            // no handler in run() either
+            fprintf(out, "    runtimeError(\"Unknown opcode %d.\", %d);\n}\n", op, line);
+            return !ferror(out);
+        }
+        offset += opcodeLength(op);
+    }
+
+    fprintf(out, "    return 0;\n}\n");
+    return !ferror(out);
+}
+
+// Emits, builds and runs one program and compares what it prints to
+// stdout and stderr and its exit status with running the chunk in vm.
+static bool crossCheck(VM *vm, Program *program, const std::string &source, const char *compiler,
+                       const std::string &directory)
+{
+    std::string sourcePath = directory + "/expression.cpp";
+    std::string binaryPath = directory + "/expression";
+    std::string expectedErrorPath = directory + "/interpreter.err";
+    std::string actualErrorPath = directory + "/generated.err";
+    FILE *out = fopen(sourcePath.c_str(), "w");
+    bool written = out != nullptr && emitCpp(&program->chunk, "aot self-test", out);
+    if (out != nullptr)
+        written = fclose(out) == 0 && written;
+    if (!written)
+    {
+        printf("aot: could not write %s\n", sourcePath.c_str());
+        return false;
+    }
+
+    std::string command = std::string(compiler) + " -std=c++17 -O0 -w -o " + binaryPath + " " + sourcePath;
+    if (system(command.c_str()) != 0)
+    {
+        printf("aot: \"%s\" failed on \"%s\"\n", command.c_str(), source.c_str());
+        return false;
+    }
+
+    Value value = NULL_VAL;
+    int savedStderr = captureStderr(expectedErrorPath.c_str());
+    InterpretResult status = execute(vm, program, &value);
+    restoreStderr(savedStderr);
+    std::string expectedError = readWholeFile(expectedErrorPath.c_str());
+    char expected[80] = "";
+    int expectedExit = status == INTERPRET_OK ? 0 : 70;
+    if (status == INTERPRET_OK)
+    {
+        int length = formatValue(expected, sizeof(expected) - 1, value);
+        expected[length] = '\n';
+        expected[length + 1] = '\0';
+    }
+
+    char actual[80] = "";
+    FILE *run = popen((binaryPath + " 2>" + actualErrorPath).c_str(), "r");
+    size_t length = run != nullptr ? fread(actual, 1, sizeof(actual) - 1, run) : 0;
+    actual[length] = '\0';
+    int waitStatus = run != nullptr ? pclose(run) : -1;
+    int actualExit = waitStatus != -1 && WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus) : -1;
+    std::string actualError = readWholeFile(actualErrorPath.c_str());
+    remove(binaryPath.c_str());
+
+    if (expectedExit == actualExit && strcmp(expected, actual) == 0 && expectedError == actualError)
+        return true;
+
+    printf("aot: mismatch on \"%s\"\n  interpreter: exit %d, %s%s", source.c_str(), expectedExit,
+           expected[0] != '\0' ? expected : "no output\n", expectedError.c_str());
+    printf("  generated:   exit %d, %s%s", actualExit, actual[0] != '\0' ? actual : "no output\n",
+           actualError.c_str());
+    return false;
+}
+
+bool aotSelfTest(int count, unsigned seed)
+{
+    const char *compiler = getenv("CXX");
+    if (compiler == nullptr || compiler[0] == '\0')
+        compiler = "c++";
+    char directory[] = "/tmp/iff-aot-XXXXXX";
+    if (mkdtemp(directory) == nullptr)
+    {
+        printf("aot: could not create a directory for the generated programs\n");
+        return false;
+    }
+
+    VM vm;
+    initVM(&vm);
+    // folding would reduce every program to a single constant
+    vm.optimize = false;
+    unsigned state = seed != 0 ? seed : 1;
+    int savedStderr = silenceStderr();
+
+    bool ok = true;
+    int checked = 0;
+    for (; checked < count && ok; checked++)
+    {
+        std::string source;
+        randomExpression(&source, &state, 1 + (int)(nextRandom(&state) % 6));
+
+        Program *program = prepare(&vm, source.c_str(), source.size());
+        if (program == nullptr)
+            continue;
+        ok = crossCheck(&vm, program, source, compiler, directory);
+        freeProgram(program);
+    }
+
+    restoreStderr(savedStderr);
+    freeVM(&vm);
+    remove((std::string(directory) + "/expression.cpp").c_str());
+    remove((std::string(directory) + "/interpreter.err").c_str());
+    remove((std::string(directory) + "/generated.err").c_str());
+    rmdir(directory);
+
+    if (ok)
+        printf("aot: %d random expressions agree (seed %u, %s)\n", checked, seed, compiler);
+    return ok;
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdio>
+#include "chunk.hpp"
+
+// Ahead-of-time backend: writes a standalone C++ translation unit that
+// computes the same result as running `chunk`, prints it the way
+// interpretProgram() does and reports runtime errors with the same
+// messages, lines and exit status as the command-line interpreter.
+// The generated program takes the values of $0, $1, ... as its
+// command-line arguments. `name` only ends up in the header comment.
+// Returns false if writing to `out` failed.
+bool emitCpp(const Chunk *chunk, const char *name, FILE *out);
+
+// Emits `count` random expressions, builds each with $CXX (c++ if unset)
+// and checks that the result and exit status agree with the interpreter.
+// Prints the first mismatch.
+bool aotSelfTest(int count, unsigned seed);
\ No newline at end of file
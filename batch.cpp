@@ -0,0 +1,303 @@
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include "batch.hpp"
+#include "memory.hpp"
+
+// The lane loops below are written for the auto-vectorizer in its
+// cheapest mode, the one GCC 12 and later run at -O2, which takes no
+// remainder loop and no runtime overlap check. A whole block runs with a
+// trip count known at compile time, and a loop over two slots indexes
+// both from the lower one, BATCH_SIZE apart, so they plainly do not
+// overlap. -O3 vectorizes them as well.
+
+struct BatchRun
+{
+    const Chunk *chunk;
+    // chunk->maxStack slots of BATCH_SIZE values each; lane i of every
+    // slot belongs to row base + i
+    Value *slots;
+    const double *const *columns;
+    int columnCount;
+    Value *results;
+};
+
+static void batchError(const Chunk *chunk, int offset, size_t row, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+    fprintf(stderr, "[line %d] in script, row %zu\n", getLine(chunk, offset), row);
+}
+
+// First lane in which a or b is not a number, or -1. The common case of
+// no bad lane at all is one branch-free pass.
+template <bool Full>
+static int firstNonNumber(const Value *a, const Value *b, int count)
+{
+    const int lanes = Full ? BATCH_SIZE : count;
+    bool bad = false;
+    for (int i = 0; i < lanes; i++)
+        bad |= !IS_NUMBER(a[i]) | !IS_NUMBER(b[i]);
+    if (!bad)
+        return -1;
+    for (int i = 0; i < lanes; i++)
+    {
+        if (!IS_NUMBER(a[i]) || !IS_NUMBER(b[i]))
+            return i;
+    }
+    return -1;
+}
+
+// Runs rows base to base + count - 1 together, where count is BATCH_SIZE
+// if Full is set. A runtime error is only reported if `report` is set;
+// see executeBatch() for why.
+template <bool Full>
+static InterpretResult runLanes(BatchRun *run, size_t base, int count, bool report)
+{
+    const Chunk *chunk = run->chunk;
+    const int lanes = Full ? BATCH_SIZE : count;
+    int depth = 0;
+
+#define SLOT(index) (run->slots + (size_t)(index) * BATCH_SIZE)
+#define FILL(value) do { \
+        Value *out = SLOT(depth++); \
+        Value fill = (value); \
+        for (int i = 0; i < lanes; i++) \
+            out[i] = fill; \
+    } while (false)
+#define CHECK_NUMBERS(a, b, message) do { \
+        int bad = firstNonNumber<Full>((a), (b), lanes); \
+        if (bad >= 0) \
+        { \
+            if (report) \
+                batchError(chunk, offset, base + bad, message); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+#define CHECK_BINARY() CHECK_NUMBERS(SLOT(depth - 2), SLOT(depth - 1), "Operands must be numbers.")
+// x and y are the two operands of each lane
+#define BINARY_LANES(valueType, expression) do { \
+        Value *a = SLOT(depth - 2); \
+        for (int i = 0; i < lanes; i++) \
+        { \
+            double x = AS_NUMBER(a[i]); \
+            double y = AS_NUMBER(a[i + BATCH_SIZE]); \
+            a[i] = valueType(expression); \
+        } \
+        depth--; \
+    } while (false)
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t op = loadOpcode(chunk->code + offset);
+        const uint8_t *operand = chunk->code + offset + 1;
+        switch (op)
+        {
+        case OP_CONSTANT:
+            FILL(chunk->constants.values[operand[0]]);
+            break;
+        case OP_CONSTANT_BIG:
+            FILL(chunk->constants.values[(operand[0] << 16) | (operand[1] << 8) | operand[2]]);
+            break;
+        case OP_INT8:
+            FILL(NUMBER_VAL((int8_t)operand[0]));
+            break;
+        case OP_INT16:
+            FILL(NUMBER_VAL((int16_t)((operand[0] << 8) | operand[1])));
+            break;
+        case OP_FIXED16:
+            FILL(NUMBER_VAL((int16_t)((operand[0] << 8) | operand[1]) / 256.0));
+            break;
+        case OP_NULL:
+            FILL(NULL_VAL);
+            break;
+        case OP_TRUE:
+            FILL(BOOL_VAL(true));
+            break;
+        case OP_FALSE:
+            FILL(BOOL_VAL(false));
+            break;
+        case OP_COLUMN:
+        {
+            if (operand[0] >= run->columnCount)
+            {
+                if (report)
+                    batchError(chunk, offset, base, "Column $%d is not bound.", operand[0]);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            const double *in = run->columns[operand[0]] + base;
+            Value *out = SLOT(depth++);
+            for (int i = 0; i < lanes; i++)
+                out[i] = NUMBER_VAL(canonicalNumber(in[i]));
+            break;
+        }
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+            CHECK_BINARY();
+            // fall through
+        case OP_ADD_UNCHECKED:
+            BINARY_LANES(NUMBER_VAL, x + y);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            CHECK_BINARY();
+            // fall through
+        case OP_SUBTRACT_UNCHECKED:
+            BINARY_LANES(NUMBER_VAL, x - y);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            CHECK_BINARY();
+            // fall through
+        case OP_MULTIPLY_UNCHECKED:
+            BINARY_LANES(NUMBER_VAL, x * y);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            CHECK_BINARY();
+            // fall through
+        case OP_DIVIDE_UNCHECKED:
+            BINARY_LANES(NUMBER_VAL, x / y);
+            break;
+        case OP_MODULO:
+            CHECK_BINARY();
+            // fall through
+        case OP_MODULO_UNCHECKED:
+            BINARY_LANES(NUMBER_VAL, fmod(x, y));
+            break;
+        case OP_POWER:
+            CHECK_BINARY();
+            // fall through
+        case OP_POWER_UNCHECKED:
+            BINARY_LANES(NUMBER_VAL, pow(x, y));
+            break;
+        case OP_GREATER:
+            CHECK_BINARY();
+            // fall through
+        case OP_GREATER_UNCHECKED:
+            BINARY_LANES(BOOL_VAL, x > y);
+            break;
+        case OP_GREATER_EQUAL:
+            CHECK_BINARY();
+            // fall through
+        case OP_GREATER_EQUAL_UNCHECKED:
+            BINARY_LANES(BOOL_VAL, x >= y);
+            break;
+        case OP_LESS:
+            CHECK_BINARY();
+            // fall through
+        case OP_LESS_UNCHECKED:
+            BINARY_LANES(BOOL_VAL, x < y);
+            break;
+        case OP_LESS_EQUAL:
+            CHECK_BINARY();
+            // fall through
+        case OP_LESS_EQUAL_UNCHECKED:
+            BINARY_LANES(BOOL_VAL, x <= y);
+            break;
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        {
+            bool equal = op == OP_EQUAL;
+            Value *a = SLOT(depth - 2);
+            for (int i = 0; i < lanes; i++)
+                a[i] = BOOL_VAL(valuesEqual(a[i], a[i + BATCH_SIZE]) == equal);
+            depth--;
+            break;
+        }
+        case OP_NOT:
+        {
+            Value *a = SLOT(depth - 1);
+            for (int i = 0; i < lanes; i++)
+                a[i] = BOOL_VAL(isFalsey(a[i]));
+            break;
+        }
+        case OP_NEGATE:
+            CHECK_NUMBERS(SLOT(depth - 1), SLOT(depth - 1), "Operand must be a number.");
+            // fall through
+        case OP_NEGATE_UNCHECKED:
+        {
+            Value *a = SLOT(depth - 1);
+            for (int i = 0; i < lanes; i++)
+                a[i] = NUMBER_VAL(-AS_NUMBER(a[i]));
+            break;
+        }
+
+        case OP_RETURN:
+        {
+            memcpy(run->results + base, SLOT(depth - 1), (size_t)lanes * sizeof(Value));
+            return INTERPRET_OK;
+        }
+        default:
+            if (report)
+                batchError(chunk, offset, base, "Unknown opcode %d.", op);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        offset += opcodeLength(op);
+    }
+    return INTERPRET_OK;
+
+#undef SLOT
+#undef FILL
+#undef CHECK_NUMBERS
+#undef CHECK_BINARY
+#undef BINARY_LANES
+}
+
+static InterpretResult runBlock(BatchRun *run, size_t base, int lanes, bool report)
+{
+    if (lanes == BATCH_SIZE)
+        return runLanes<true>(run, base, lanes, report);
+    return runLanes<false>(run, base, lanes, report);
+}
+
+InterpretResult executeBatch(const Program *program, const double *const *columns, int columnCount,
+                             size_t rowCount, Value *results)
+{
+    const Chunk *chunk = &program->chunk;
+    if (chunk->maxStack < 0 || chunk->maxStack > STACK_MAX)
+    {
+        fprintf(stderr, "Stack overflow: expression needs %d slots, the limit is %d.\n",
+                chunk->maxStack, STACK_MAX);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    BatchRun run;
+    run.chunk = chunk;
+    size_t slotCount = (size_t)(chunk->maxStack > 0 ? chunk->maxStack : 1) * BATCH_SIZE;
+    run.slots = ALLOCATE(MEMORY_STACK, Value, slotCount);
+    if (run.slots == nullptr)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    run.columns = columns;
+    run.columnCount = columnCount;
+    run.results = results;
+
+    InterpretResult status = INTERPRET_OK;
+    for (size_t base = 0; base < rowCount && status == INTERPRET_OK; base += BATCH_SIZE)
+    {
+        int lanes = rowCount - base < BATCH_SIZE ? (int)(rowCount - base) : BATCH_SIZE;
+        status = runBlock(&run, base, lanes, lanes == 1);
+        // A block stops at the first instruction any of its rows fails,
+        // which need not be where the first failing row fails on its own
+        // (that row may get through this instruction and fail a later
+        // one). Running the rows one at a time finds and reports the same
+        // row and error that evaluating them in order would.
+        for (int i = 0; status != INTERPRET_OK && lanes > 1 && i < lanes; i++)
+        {
+            if (runBlock(&run, base + i, 1, true) != INTERPRET_OK)
+                break;
+        }
+    }
+
+    FREE_ARRAY(MEMORY_STACK, Value, run.slots, slotCount);
+    return status;
+}
\ No newline at end of file
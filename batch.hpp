@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include "vm.hpp"
+
+// rows evaluated together by every instruction of a batch run
+#define BATCH_SIZE 1024
+
+// Evaluates `program` once per row, with $k reading columns[k][row], and
+// stores each row's result in results[row]. Instead of dispatching every
+// instruction once per row, each instruction runs as one loop over a
+// block of BATCH_SIZE rows, with a stack slot holding a value per row.
+// A runtime error stops the run and is reported with the row it
+// happened in. The row and message are the ones evaluating the rows one
+// by one, in order, would report, even though a block checks all of its
+// rows at each instruction.
+InterpretResult executeBatch(const Program *program, const double *const *columns, int columnCount,
+                             size_t rowCount, Value *results);
\ No newline at end of file
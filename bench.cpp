@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench.hpp"
+#include "scanner.hpp"
+#include "vm.hpp"
+
+#define BENCH_REPEATS 7
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Fastest of BENCH_REPEATS runs of body(), in seconds.
+template <typename Body>
+static double bestOf(Body body)
+{
+    double best = 1e300;
+    for (int i = 0; i < BENCH_REPEATS; i++)
+    {
+        double start = now();
+        body();
+        best = std::min(best, now() - start);
+    }
+    return best;
+}
+
+// instructions in a chunk, which for straight-line code is also how many
+// one run of it executes
+static int instructionCount(const Chunk *chunk)
+{
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+        count++;
+    return count;
+}
+
+static Program *prepareOrDie(VM *vm, const std::string &source)
+{
+    Program *program = prepare(vm, source.c_str(), source.size());
+    if (program == nullptr)
+    {
+        fprintf(stderr, "bench: could not compile the benchmark script\n");
+        exit(70);
+    }
+    return program;
+}
+
+// Executes program `runs` times and prints the cost per instruction.
+static void timeExecution(VM *vm, const Program *program, int runs, const char *label)
+{
+    double seconds = bestOf([&] {
+        Value result;
+        for (int i = 0; i < runs; i++)
+            execute(vm, program, &result);
+    });
+    double instructions = (double)instructionCount(&program->chunk) * runs;
+    printf("%-24s %8.3f ms %8.2f ns/instruction\n", label, seconds * 1e3, seconds * 1e9 / instructions);
+}
+
+// Long arithmetic chains, unoptimized so that every operator is a
+// dispatch: one of literals, whose operators the compiler proves numeric,
+// and one of columns, which go through the checked and quickened ones.
+static void dispatchBenchmark()
+{
+    std::string literals;
+    std::string columns;
+    for (int i = 0; i < 50000; i++)
+    {
+        literals += std::to_string(i % 100) + " * 2.5 - " + std::to_string(i % 7) + " / 3 + ";
+        columns += "$0 * 2.5 - $1 / 3 + ";
+    }
+    literals += "1";
+    columns += "1";
+
+    VM vm;
+    initVM(&vm);
+    vm.optimize = false;
+    Value bound[2] = {NUMBER_VAL(7), NUMBER_VAL(9)};
+    vm.columns = bound;
+    vm.columnCount = 2;
+
+    Program *program = prepareOrDie(&vm, literals);
+    timeExecution(&vm, program, 20, "dispatch/literals");
+    freeProgram(program);
+    program = prepareOrDie(&vm, columns);
+    timeExecution(&vm, program, 20, "dispatch/columns");
+    freeProgram(program);
+    freeVM(&vm);
+}
+
+// Operands nested a thousand deep, so that nearly the whole stack is in
+// use, read from a constant pool far larger than the caches; the cost is
+// moving Values around rather than computing with them.
+static void stackBenchmark()
+{
+    std::string source;
+    int constant = 0;
+    for (int chain = 0; chain < 100; chain++)
+    {
+        if (chain > 0)
+            source += " + ";
+        for (int depth = 0; depth < 1000; depth++)
+            source += std::to_string(constant++) + ".5 - (";
+        source += "1";
+        source.append(1000, ')');
+    }
+
+    VM vm;
+    initVM(&vm);
+    vm.optimize = false;
+    Program *program = prepareOrDie(&vm, source);
+    timeExecution(&vm, program, 20, "stack/nested");
+    printf("%-24s %8d slots %8.1f KB of constants\n", "stack/footprint", program->chunk.maxStack,
+           program->chunk.constants.count * sizeof(Value) / 1024.0);
+    freeProgram(program);
+    freeVM(&vm);
+}
+
+// A service's worth of small expressions, each evaluated many times:
+// compiled on every evaluation, which is what interpret() does apart from
+// printing the result, against prepared once and only executed.
+static void preparedBenchmark()
+{
+    const int expressionCount = 2000;
+    const int rounds = 20;
+    std::string sources[expressionCount];
+    for (int i = 0; i < expressionCount; i++)
+    {
+        sources[i] = "$0 * " + std::to_string(i % 97) + ".25 + $1 / " + std::to_string(1 + i % 13) +
+                     " - (" + std::to_string(i) + " % 7) > $1 - " + std::to_string(i % 5);
+    }
+
+    VM vm;
+    initVM(&vm);
+    Value bound[2] = {NUMBER_VAL(7), NUMBER_VAL(9)};
+    vm.columns = bound;
+    vm.columnCount = 2;
+
+    double compiling = bestOf([&] {
+        Value result;
+        for (int round = 0; round < rounds; round++)
+        {
+            for (int i = 0; i < expressionCount; i++)
+            {
+                Program *program = prepareOrDie(&vm, sources[i]);
+                execute(&vm, program, &result);
+                freeProgram(program);
+            }
+        }
+    });
+
+    Program *programs[expressionCount];
+    for (int i = 0; i < expressionCount; i++)
+        programs[i] = prepareOrDie(&vm, sources[i]);
+    double prepared = bestOf([&] {
+        Value result;
+        for (int round = 0; round < rounds; round++)
+        {
+            for (int i = 0; i < expressionCount; i++)
+                execute(&vm, programs[i], &result);
+        }
+    });
+    for (int i = 0; i < expressionCount; i++)
+        freeProgram(programs[i]);
+    freeVM(&vm);
+
+    double evaluations = (double)expressionCount * rounds;
+    printf("%-24s %8.3f ms %8.1f ns/evaluation\n", "prepared/compile-each", compiling * 1e3,
+           compiling * 1e9 / evaluations);
+    printf("%-24s %8.3f ms %8.1f ns/evaluation\n", "prepared/execute", prepared * 1e3,
+           prepared * 1e9 / evaluations);
+}
+
+// Each thread compiles and runs scripts with a VM of its own, the same
+// amount of work per thread whatever their number, so with enough cores
+// the time stays flat and throughput grows with the threads.
+static void threadsWorker(int scripts)
+{
+    VM vm;
+    initVM(&vm);
+    Value bound[2] = {NUMBER_VAL(7), NUMBER_VAL(9)};
+    vm.columns = bound;
+    vm.columnCount = 2;
+    for (int i = 0; i < scripts; i++)
+    {
+        std::string source;
+        for (int term = 0; term < 200; term++)
+            source += "$0 * " + std::to_string((i + term) % 89) + ".5 - $1 / 3 + ";
+        source += "1";
+        Program *program = prepareOrDie(&vm, source);
+        Value result;
+        for (int run = 0; run < 20; run++)
+            execute(&vm, program, &result);
+        freeProgram(program);
+    }
+    freeVM(&vm);
+}
+
+static void threadsBenchmark()
+{
+    const int scripts = 200;
+    int cores = (int)std::thread::hardware_concurrency();
+    printf("%-24s %8d\n", "threads/cores", cores);
+    std::vector<int> counts = {1, 2, 4};
+    if (cores > 4)
+        counts.push_back(cores);
+    double single = 0;
+    for (int count : counts)
+    {
+        double seconds = bestOf([&] {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < count; i++)
+                threads.emplace_back(threadsWorker, scripts);
+            for (std::thread &thread : threads)
+                thread.join();
+        });
+        double throughput = count * scripts / seconds;
+        if (count == 1)
+            single = throughput;
+        char label[32];
+        snprintf(label, sizeof(label), "threads/%d", count);
+        printf("%-24s %8.3f ms %8.0f scripts/s %5.2fx\n", label, seconds * 1e3, throughput, throughput / single);
+    }
+}
+
+// Scans source to the end and prints the cost per token; every "${"
+// goes through the scanner's token queue.
+static void timeScanning(const std::string &source, const char *label)
+{
+    long tokens = 0;
+    double seconds = bestOf([&] {
+        Scanner scanner;
+        initScanner(&scanner, source.c_str(), source.size());
+        tokens = 0;
+        for (;;)
+        {
+            Token token = scanToken(&scanner);
+            tokens++;
+            if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR)
+                break;
+        }
+    });
+    printf("%-24s %8.3f ms %8.2f ns/token (%ld tokens)\n", label, seconds * 1e3, seconds * 1e9 / tokens, tokens);
+}
+
+// Long templates, one with a hundred thousand "${...}" in a row and one
+// of a thousand templates each nested a hundred deep.
+static void interpolationBenchmark()
+{
+    std::string flat;
+    for (int i = 0; i < 100000; i++)
+        flat += "\"text ${" + std::to_string(i) + "}";
+    timeScanning(flat, "interpolation/flat");
+
+    std::string nested;
+    for (int i = 0; i < 1000; i++)
+    {
+        for (int depth = 0; depth < 100; depth++)
+            nested += "\"text ${";
+        nested += std::to_string(i);
+        nested.append(100, '}');
+        nested += " ";
+    }
+    timeScanning(nested, "interpolation/nested");
+}
+
+struct Benchmark
+{
+    const char *name;
+    void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+    {"dispatch", dispatchBenchmark},
+    {"stack", stackBenchmark},
+    {"prepared", preparedBenchmark},
+    {"threads", threadsBenchmark},
+    {"interpolation", interpolationBenchmark},
+};
+
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void printBuild()
+{
+#ifdef THREADED_DISPATCH
+    const char *dispatch = "threaded";
+#else
+    const char *dispatch = "switch";
+#endif
+    printf("[bench] %s dispatch, %zu-byte Value\n", dispatch, sizeof(Value));
+}
+
+bool runBenchmark(const char *name)
+{
+    bool all = strcmp(name, "all") == 0;
+    bool found = false;
+    for (int i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        if (!all && strcmp(name, benchmarks[i].name) != 0)
+            continue;
+        if (!found)
+            printBuild();
+        found = true;
+        benchmarks[i].run();
+    }
+    if (!found)
+    {
+        fprintf(stderr, "Unknown benchmark \"%s\"; known are all", name);
+        for (int i = 0; i < BENCHMARK_COUNT; i++)
+            fprintf(stderr, ", %s", benchmarks[i].name);
+        fprintf(stderr, ".\n");
+    }
+    return found;
+}
\ No newline at end of file
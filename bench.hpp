@@ -0,0 +1,8 @@
+#pragma once
+
+// Timings of the interpreter's hot paths, for comparing builds and
+// changes: --bench <name> runs one benchmark, --bench all runs every one.
+// Each reports the best of several repetitions, so it should be run on an
+// otherwise idle machine. Returns false for an unknown name, after
+// listing the known ones.
+bool runBenchmark(const char *name);
\ No newline at end of file
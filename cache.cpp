@@ -0,0 +1,308 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.hpp"
+#include "jit.hpp"
+#include "memory.hpp"
+
+enum CacheTag : uint8_t
+{
+    CACHE_NULL,
+    CACHE_FALSE,
+    CACHE_TRUE,
+    CACHE_NUMBER,
+};
+
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t opCount;     // guards against stale files after the OpCode enum grows
+    uint32_t flags;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint64_t sourceHash;
+    uint64_t payloadHash; // detects truncation and bit rot in everything after the header
+};
+
+#define LINE_ENTRY_SIZE     8
+#define CONSTANT_ENTRY_SIZE 9
+
+// FNV-1a, which is plenty for telling sources and payloads apart
+static uint64_t fnv1a(const uint8_t* bytes, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t hashSource(const char* source, size_t length)
+{
+    return fnv1a((const uint8_t*)source, length);
+}
+
+static void putU32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out.push_back((value >> (8 * i)) & 0xFF);
+}
+
+static void putU64(std::vector<uint8_t>& out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        out.push_back((value >> (8 * i)) & 0xFF);
+}
+
+static uint32_t getU32(const uint8_t* in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)in[i] << (8 * i);
+    return value;
+}
+
+static uint64_t getU64(const uint8_t* in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+bool saveCachedProgram(const char* path, const Program* program, uint64_t sourceHash, uint32_t flags)
+{
+    const Chunk* chunk = &program->chunk;
+
+    std::vector<uint8_t> payload(chunk->code, chunk->code + chunk->count);
+    for (int i = 0; i < chunk->lineCount; i++)
+    {
+        putU32(payload, (uint32_t)chunk->lines[i].offset);
+        putU32(payload, (uint32_t)chunk->lines[i].line);
+    }
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value value = chunk->constants.values[i];
+        uint64_t bits = 0;
+        if (IS_NUMBER(value))
+        {
+            double number = AS_NUMBER(value);
+            memcpy(&bits, &number, sizeof(double));
+            payload.push_back(CACHE_NUMBER);
+        }
+        else if (IS_BOOL(value))
+        {
+            payload.push_back(AS_BOOL(value) ? CACHE_TRUE : CACHE_FALSE);
+        }
+        else
+        {
+            payload.push_back(CACHE_NULL);
+        }
+        putU64(payload, bits);
+    }
+
+    std::vector<uint8_t> header;
+    header.insert(header.end(), CACHE_MAGIC, CACHE_MAGIC + 4);
+    putU32(header, CACHE_VERSION);
+    putU32(header, OP_COUNT);
+    putU32(header, flags);
+    putU32(header, (uint32_t)chunk->count);
+    putU32(header, (uint32_t)chunk->lineCount);
+    putU32(header, (uint32_t)chunk->constants.count);
+    putU64(header, sourceHash);
+    putU64(header, fnv1a(payload.data(), payload.size()));
+
+    // write to a temporary name and rename, so readers never see a
+    // half-written file
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+    bool ok = fwrite(header.data(), 1, header.size(), file) == header.size() &&
+              fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temporary.c_str(), path) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Walks the decoded code and makes sure run() can execute it without
+// reading outside the chunk: every opcode is known, operands are in
+// bounds and the program ends in OP_RETURN.
+static bool validateCode(const Chunk* chunk)
+{
+    int offset = 0;
+    uint8_t op = OP_RETURN;
+    while (offset < chunk->count)
+    {
+        op = chunk->code[offset];
+        if (op >= OP_COUNT || offset + opcodeLength(op) > chunk->count)
+            return false;
+
+        if (op == OP_CONSTANT && chunk->code[offset + 1] >= chunk->constants.count)
+            return false;
+        if (op == OP_CONSTANT_BIG)
+        {
+            int index = (chunk->code[offset + 1] << 16) |
+                        (chunk->code[offset + 2] << 8) |
+                        chunk->code[offset + 3];
+            if (index >= chunk->constants.count)
+                return false;
+        }
+        offset += opcodeLength(op);
+    }
+    return chunk->count > 0 && op == OP_RETURN;
+}
+
+// The file does not store the stack depth: it is recounted from the
+// code, which also rejects code that would pop an empty stack.
+static bool validateStack(Chunk* chunk)
+{
+    chunk->maxStack = computeMaxStack(chunk);
+    return chunk->maxStack >= 0;
+}
+
+static bool decodeProgram(const uint8_t* data, size_t size, uint64_t sourceHash, uint32_t flags, Chunk* chunk)
+{
+    const size_t headerSize = 4 + 6 * 4 + 2 * 8;
+    if (size < headerSize || memcmp(data, CACHE_MAGIC, 4) != 0)
+        return false;
+    if (getU32(data + 4) != CACHE_VERSION || getU32(data + 8) != OP_COUNT || getU32(data + 12) != flags)
+        return false;
+
+    uint64_t codeCount = getU32(data + 16);
+    uint64_t lineCount = getU32(data + 20);
+    uint64_t constantCount = getU32(data + 24);
+    if (getU64(data + 28) != sourceHash)
+        return false;
+
+    uint64_t payloadSize = codeCount + lineCount * LINE_ENTRY_SIZE + constantCount * CONSTANT_ENTRY_SIZE;
+    if (payloadSize != size - headerSize)
+        return false;
+    const uint8_t* payload = data + headerSize;
+    if (fnv1a(payload, payloadSize) != getU64(data + 36))
+        return false;
+
+    const uint8_t* code = payload;
+    const uint8_t* lines = code + codeCount;
+    const uint8_t* constants = lines + lineCount * LINE_ENTRY_SIZE;
+
+    for (uint64_t i = 0; i < constantCount; i++)
+    {
+        const uint8_t* entry = constants + i * CONSTANT_ENTRY_SIZE;
+        Value value;
+        switch (entry[0])
+        {
+        case CACHE_NULL:  value = NULL_VAL;        break;
+        case CACHE_FALSE: value = BOOL_VAL(false); break;
+        case CACHE_TRUE:  value = BOOL_VAL(true);  break;
+        case CACHE_NUMBER:
+        {
+            uint64_t bits = getU64(entry + 1);
+            double number;
+            memcpy(&number, &bits, sizeof(double));
+            value = NUMBER_VAL(canonicalNumber(number));
+            break;
+        }
+        default:
+            return false;
+        }
+        // a well-formed pool has no duplicates, so interning keeps indices
+        if (addConstant(chunk, value) != (int)i)
+            return false;
+    }
+
+    // Rebuild the line table through writeChunk() so the chunk ends up
+    // exactly as the compiler would have produced it; the runs must be
+    // sorted and cover the code from offset 0.
+    int run = -1;
+    int runEnd = 0;
+    int line = 0;
+    for (uint64_t offset = 0; offset < codeCount; offset++)
+    {
+        while ((int)offset >= runEnd)
+        {
+            run++;
+            if ((uint64_t)run >= lineCount)
+                return false;
+            const uint8_t* entry = lines + run * LINE_ENTRY_SIZE;
+            if (getU32(entry) != (run == 0 ? 0 : (uint32_t)runEnd))
+                return false;
+            line = (int)getU32(entry + 4);
+            runEnd = (uint64_t)run + 1 < lineCount ? (int)getU32(entry + LINE_ENTRY_SIZE) : (int)codeCount;
+            if (runEnd <= (int)offset)
+                return false;
+        }
+        writeChunk(chunk, code[offset], line);
+    }
+    if ((uint64_t)(run + 1) != lineCount || chunk->lineCount != (int)lineCount)
+        return false;
+
+    return validateCode(chunk) && validateStack(chunk);
+}
+
+Program* loadCachedProgram(VM* vm, const char* path, uint64_t sourceHash, uint32_t flags)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    // set up as prepare() does: the program's memory comes from its own
+    // arena and is charged to the VM
+    vm->memory.exhausted = false;
+    MemoryAccount* previous = useMemoryAccount(&vm->memory);
+    Program* program = ALLOCATE(MEMORY_OTHER, Program, 1);
+    bool ok = program != nullptr;
+    if (ok)
+    {
+        initChunk(&program->chunk);
+        program->native = nullptr;
+        initArena(&program->arena);
+        program->account = &vm->memory;
+        Allocator* previousAllocator = useAllocator(&program->arena.allocator);
+        ok = decodeProgram((const uint8_t*)data, size, sourceHash, flags, &program->chunk) &&
+             !vm->memory.exhausted;
+        if (ok && vm->jit)
+        {
+            program->native = compileNative(&program->chunk);
+            ok = !vm->memory.exhausted;
+        }
+        useAllocator(previousAllocator);
+    }
+    useMemoryAccount(previous);
+    munmap(data, size);
+
+    if (!ok)
+    {
+        if (program != nullptr)
+            freeProgram(program);
+        return nullptr;
+    }
+    return program;
+}
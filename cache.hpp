@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include "common.hpp"
+#include "vm.hpp"
+
+// With --cache, compiled programs are cached on disk next to their source
+// so that a warm start skips scanning and compiling. A cache file records
+// the hash of the source it was compiled from, and the options that affect
+// code generation, and is only used when both match.
+//
+// Layout (all integers little endian):
+//   CacheHeader
+//   code         codeCount bytes
+//   line table   lineCount x (int32 offset, int32 line)
+//   constants    constantCount x (uint8 tag, 8 payload bytes)
+
+#define CACHE_MAGIC   "IFFB"
+#define CACHE_VERSION 1
+
+// CacheHeader.flags
+#define CACHE_OPTIMIZED 0x1
+
+uint64_t hashSource(const char* source, size_t length);
+// The program lives in its own arena and is charged to vm's memory
+// account, and is translated to native code if vm->jit is set, all as if
+// prepare() had compiled it.
+Program* loadCachedProgram(VM* vm, const char* path, uint64_t sourceHash, uint32_t flags);
+bool saveCachedProgram(const char* path, const Program* program, uint64_t sourceHash, uint32_t flags);
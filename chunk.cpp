@@ -1,32 +1,105 @@
+#include <cmath>
+#include <cstring>
 #include "chunk.hpp"
 #include "memory.hpp"
 #include "value.hpp"
 
+#define CONSTANT_SLOTS_MAX_LOAD 0.75
+
 void initChunk(Chunk *chunk)
 {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = nullptr;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = nullptr;
     initValueArray(&chunk->constants);
+    chunk->constantSlotCapacity = 0;
+    chunk->constantSlots = nullptr;
+    chunk->maxStack = 0;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
-        int oldCapacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        uint8_t *code = GROW_ARRAY(MEMORY_CODE, uint8_t, chunk->code, chunk->capacity, capacity);
+        // out of memory: the byte is dropped and the account that ran out
+        // tells whoever is compiling to throw the chunk away
+        if (code == nullptr)
+            return;
+        chunk->code = code;
+        chunk->capacity = capacity;
     }
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // still on the same line as the previous byte
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int capacity = GROW_CAPACITY(chunk->lineCapacity);
+        LineStart *lines = GROW_ARRAY(MEMORY_LINES, LineStart, chunk->lines, chunk->lineCapacity, capacity);
+        if (lines == nullptr)
+            return;
+        chunk->lines = lines;
+        chunk->lineCapacity = capacity;
+    }
+    LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+// Picks the smallest immediate encoding that reproduces value exactly.
+// -0 is left to the constant pool since every immediate decodes to +0.
+static bool writeImmediate(Chunk *chunk, Value value, int line)
+{
+    if (!IS_NUMBER(value))
+        return false;
+    double number = AS_NUMBER(value);
+    if (number == 0 && std::signbit(number))
+        return false;
+
+    if (number >= INT8_MIN && number <= INT8_MAX && number == (int8_t)number)
+    {
+        writeChunk(chunk, OP_INT8, line);
+        writeChunk(chunk, (uint8_t)(int8_t)number, line);
+        return true;
+    }
+
+    uint8_t op;
+    int16_t immediate;
+    if (number >= INT16_MIN && number <= INT16_MAX && number == (int16_t)number)
+    {
+        op = OP_INT16;
+        immediate = (int16_t)number;
+    }
+    else if (number * 256 >= INT16_MIN && number * 256 <= INT16_MAX &&
+             number * 256 == (int16_t)(number * 256))
+    {
+        op = OP_FIXED16;
+        immediate = (int16_t)(number * 256);
+    }
+    else
+    {
+        return false;
+    }
+
+    writeChunk(chunk, op, line);
+    writeChunk(chunk, ((uint16_t)immediate >> 8) & 0xFF, line);
+    writeChunk(chunk, (uint16_t)immediate & 0xFF, line);
+    return true;
 }
 
 void writeConstant(Chunk *chunk, Value value, int line)
 {
+    if (writeImmediate(chunk, value, line))
+        return;
+
     int constantIndex = addConstant(chunk, value);
     if (constantIndex > 0xFF)
     {
@@ -44,14 +117,222 @@ void writeConstant(Chunk *chunk, Value value, int line)
 
 void freeChunk(Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(MEMORY_CODE, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(MEMORY_LINES, LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(MEMORY_CONSTANTS, int, chunk->constantSlots, chunk->constantSlotCapacity);
     initChunk(chunk);
 }
 
+// Constants are interned by type and exact bit pattern rather than by
+// valuesEqual(), so 0 and -0 (or two NaNs) keep separate slots.
+static uint64_t constantBits(Value value)
+{
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    if (IS_NUMBER(value))
+        memcpy(&bits, &AS_NUMBER(value), sizeof(double));
+    else if (IS_BOOL(value))
+        bits = AS_BOOL(value);
+    return bits ^ ((uint64_t)value.type << 56);
+#endif
+}
+
+static uint32_t hashConstant(uint64_t bits)
+{
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static int *findConstantSlot(int *slots, int capacity, ValueArray *constants, uint64_t bits)
+{
+    uint32_t index = hashConstant(bits) & (capacity - 1);
+    for (;;)
+    {
+        int *slot = &slots[index];
+        if (*slot == -1 || constantBits(constants->values[*slot]) == bits)
+            return slot;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growConstantSlots(Chunk *chunk)
+{
+    int capacity = GROW_CAPACITY(chunk->constantSlotCapacity);
+    int *slots = GROW_ARRAY(MEMORY_CONSTANTS, int, nullptr, 0, capacity);
+    if (slots == nullptr)
+        return;
+    for (int i = 0; i < capacity; i++)
+        slots[i] = -1;
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        uint64_t bits = constantBits(chunk->constants.values[i]);
+        *findConstantSlot(slots, capacity, &chunk->constants, bits) = i;
+    }
+
+    FREE_ARRAY(MEMORY_CONSTANTS, int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlots = slots;
+    chunk->constantSlotCapacity = capacity;
+}
+
 int addConstant(Chunk *chunk, Value value)
 {
-    writeValueArray(&chunk->constants, value);
-    return chunk->constants.count - 1;
+    if (chunk->constants.count + 1 > chunk->constantSlotCapacity * CONSTANT_SLOTS_MAX_LOAD)
+        growConstantSlots(chunk);
+    // out of memory, see writeChunk(); a table that could not grow must
+    // not be filled past its load factor or probing would never end
+    if (chunk->constantSlots == nullptr ||
+        chunk->constants.count + 1 > chunk->constantSlotCapacity * CONSTANT_SLOTS_MAX_LOAD)
+        return 0;
+
+    uint64_t bits = constantBits(value);
+    int *slot = findConstantSlot(chunk->constantSlots, chunk->constantSlotCapacity,
+                                 &chunk->constants, bits);
+    if (*slot != -1)
+        return *slot;
+
+    if (!writeValueArray(&chunk->constants, value))
+        return 0;
+    *slot = chunk->constants.count - 1;
+    return *slot;
+}
+
+int getLine(const Chunk *chunk, int offset)
+{
+    // binary search for the last run that starts at or before offset
+    int start = 0;
+    int end = chunk->lineCount - 1;
+    int line = 0;
+    while (start <= end)
+    {
+        int mid = start + (end - start) / 2;
+        const LineStart *lineStart = &chunk->lines[mid];
+        if (lineStart->offset <= offset)
+        {
+            line = lineStart->line;
+            start = mid + 1;
+        }
+        else
+        {
+            end = mid - 1;
+        }
+    }
+    return line;
+}
+
+// size of an instruction in bytes, including its operands
+int opcodeLength(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_INT8:
+    case OP_COLUMN:
+        return 2;
+    case OP_INT16:
+    case OP_FIXED16:
+        return 3;
+    case OP_CONSTANT_BIG:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// the opcode a quickened or unchecked instruction was specialized from
+uint8_t genericOpcode(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD_NUM:
+        return OP_ADD;
+    case OP_SUBTRACT_NUM:
+        return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+        return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:
+        return OP_DIVIDE;
+    case OP_NEGATE_UNCHECKED:
+        return OP_NEGATE;
+    case OP_ADD_UNCHECKED:
+        return OP_ADD;
+    case OP_SUBTRACT_UNCHECKED:
+        return OP_SUBTRACT;
+    case OP_MULTIPLY_UNCHECKED:
+        return OP_MULTIPLY;
+    case OP_DIVIDE_UNCHECKED:
+        return OP_DIVIDE;
+    case OP_MODULO_UNCHECKED:
+        return OP_MODULO;
+    case OP_POWER_UNCHECKED:
+        return OP_POWER;
+    case OP_GREATER_UNCHECKED:
+        return OP_GREATER;
+    case OP_GREATER_EQUAL_UNCHECKED:
+        return OP_GREATER_EQUAL;
+    case OP_LESS_UNCHECKED:
+        return OP_LESS;
+    case OP_LESS_EQUAL_UNCHECKED:
+        return OP_LESS_EQUAL;
+    default:
+        return op;
+    }
+}
+
+// how many values an instruction pops, and how many it pushes back
+static void stackEffect(uint8_t op, int *pops, int *pushes)
+{
+    switch (genericOpcode(op))
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_BIG:
+    case OP_INT8:
+    case OP_INT16:
+    case OP_FIXED16:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_COLUMN:
+        *pops = 0;
+        *pushes = 1;
+        return;
+    case OP_RETURN:
+        *pops = 1;
+        *pushes = 0;
+        return;
+    case OP_NEGATE:
+    case OP_NOT:
+        *pops = 1;
+        *pushes = 1;
+        return;
+    default:
+        // every binary operator
+        *pops = 2;
+        *pushes = 1;
+        return;
+    }
+}
+
+// There are no jumps, so one linear walk sees every reachable depth.
+// Returns -1 if some instruction would pop more than the stack holds.
+int computeMaxStack(const Chunk *chunk)
+{
+    int depth = 0;
+    int maxDepth = 0;
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(chunk->code[offset]))
+    {
+        int pops, pushes;
+        stackEffect(chunk->code[offset], &pops, &pushes);
+        if (depth < pops)
+            return -1;
+        depth += pushes - pops;
+        if (depth > maxDepth)
+            maxDepth = depth;
+    }
+    return maxDepth;
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 
 #include "common.hpp"
 #include "value.hpp"
+#if !defined(__GNUC__)
+#include <atomic>
+#endif
 
 enum OpCode
 {
@@ -9,10 +12,16 @@ enum OpCode
     // Constants
     OP_CONSTANT,
     OP_CONSTANT_BIG,
+    // Immediates, the value is encoded in the operand bytes
+    OP_INT8,    // signed 8-bit integer
+    OP_INT16,   // signed 16-bit integer, big endian
+    OP_FIXED16, // signed 8.8 fixed point, big endian
     // Literals
     OP_NULL,
     OP_TRUE,
     OP_FALSE,
+    // Inputs
+    OP_COLUMN, // one byte column index, the value of $index for this row
     // Arithmetic
     OP_NEGATE,
     OP_ADD,
@@ -35,6 +44,35 @@ enum OpCode
     OP_NOT,
     OP_AND,
     OP_OR,
+    // Quickened, rewritten in place by run() from the generic opcode
+    // once it has seen number operands; they fall back if that changes
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    // Unchecked, emitted by the compiler when it has proven every operand
+    // is a number; they skip the type checks entirely
+    OP_NEGATE_UNCHECKED,
+    OP_ADD_UNCHECKED,
+    OP_SUBTRACT_UNCHECKED,
+    OP_MULTIPLY_UNCHECKED,
+    OP_DIVIDE_UNCHECKED,
+    OP_MODULO_UNCHECKED,
+    OP_POWER_UNCHECKED,
+    OP_GREATER_UNCHECKED,
+    OP_GREATER_EQUAL_UNCHECKED,
+    OP_LESS_UNCHECKED,
+    OP_LESS_EQUAL_UNCHECKED,
+
+    OP_COUNT
+};
+
+// Run-length encoded line table: one entry for every run of bytes that
+// came from the same source line, sorted by offset.
+struct LineStart
+{
+    int offset;
+    int line;
 };
 
 struct Chunk
@@ -42,12 +80,48 @@ struct Chunk
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart *lines;
     ValueArray constants;
+    // open-addressed hash of indices into constants, -1 marks a free slot
+    int constantSlotCapacity;
+    int *constantSlots;
+    // deepest the operand stack gets while running this chunk, filled in
+    // by computeMaxStack() once the code is final
+    int maxStack;
 };
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
-void writeConstant(Chunk *chunk, Value value, int line);
\ No newline at end of file
+void writeConstant(Chunk *chunk, Value value, int line);
+int getLine(const Chunk *chunk, int offset);
+int opcodeLength(uint8_t op);
+
+// Opcode bytes of a shared Program are rewritten by run() quickening in
+// one VM while other VMs may be reading them, so opcodes are loaded and
+// stored atomically. Relaxed order is enough, as any opcode a reader can
+// see there computes the same thing, and both compile to plain byte moves.
+// Operand bytes are never rewritten and are read as usual.
+static inline uint8_t loadOpcode(const uint8_t *code)
+{
+#if defined(__GNUC__)
+    return __atomic_load_n(code, __ATOMIC_RELAXED);
+#else
+    return std::atomic_ref<uint8_t>(*const_cast<uint8_t *>(code)).load(std::memory_order_relaxed);
+#endif
+}
+
+static inline void storeOpcode(uint8_t *code, uint8_t op)
+{
+#if defined(__GNUC__)
+    __atomic_store_n(code, op, __ATOMIC_RELAXED);
+#else
+    std::atomic_ref<uint8_t>(*code).store(op, std::memory_order_relaxed);
+#endif
+}
+
+uint8_t genericOpcode(uint8_t op);
+int computeMaxStack(const Chunk *chunk);
\ No newline at end of file
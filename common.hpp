@@ -2,5 +2,31 @@
 
 #include <cstdint>
 #include <string>
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
\ No newline at end of file
+
+// pack Values into a single 64-bit word instead of a tagged union;
+// -DNO_NAN_BOXING builds the tagged union, for comparison
+#ifndef NO_NAN_BOXING
+    #define NAN_BOXING
+#endif
+
+// labels-as-values dispatch for run(), falls back to a switch elsewhere;
+// -DNO_THREADED_DISPATCH builds the switch anyway, for comparison
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_THREADED_DISPATCH)
+    #define THREADED_DISPATCH
+#endif
+
+// 16-bytes-at-a-time fast paths in the scanner. They load whole aligned
+// blocks around the bytes they look at, which AddressSanitizer reports.
+#if defined(__has_feature)
+    #if __has_feature(address_sanitizer)
+        #define SCANNER_NO_SIMD
+    #endif
+#endif
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__) && !defined(SCANNER_NO_SIMD)
+    #define SCANNER_SSE2
+#endif
+
+// native code generation in jit.cpp, which relies on the NaN-boxed layout
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+    #define JIT_X64
+#endif
\ No newline at end of file
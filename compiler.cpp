@@ -2,19 +2,35 @@
 #include "compiler.hpp"
 #include "common.hpp"
 #include "chunk.hpp"
-#ifdef DEBUG_PRINT_CODE
-    #include "debug.hpp"
-#endif
+#include "memory.hpp"
 #include <string>
 #include <cstdio>
 #include <cstdlib>
-#include <unordered_map>
+#include <cstring>
+
+// Static type of the expression parsed last, as far as the compiler can
+// prove it without running the code.
+enum ExprType {
+    EXPR_UNKNOWN,
+    EXPR_NUMBER,
+    EXPR_BOOL,
+    EXPR_NULL
+};
 
+// Everything one compile() call needs; lives on that call's stack so
+// separate threads can compile at the same time.
 struct Parser {
+    Scanner scanner;
+    // tokens scanned ahead of time by scanAll(), read instead of the
+    // scanner when not null
+    const TokenArray* tokens;
+    int nextToken;
+    Chunk* compilingChunk;
     Token previous;
     Token current;
     bool hadError;
     bool panicMode;
+    ExprType exprType;
 };
 
 enum Precedence {
@@ -34,7 +50,7 @@ enum Precedence {
     PREC_PRIMARY
 };
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(Parser* parser);
 
 struct ParseRule {
     ParseFn prefix;
@@ -42,20 +58,17 @@ struct ParseRule {
     Precedence precedence;
 };
 
-static void expression();
-static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-
-Parser parser;
-Chunk* compilingChunk;
+static void expression(Parser* parser);
+static const ParseRule* getRule(TokenType type);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static Chunk* currentChunk(){
-    return compilingChunk;
+static Chunk* currentChunk(Parser* parser){
+    return parser->compilingChunk;
 }
 
-static void errorAt(Token* token, const char* msg) {
-    if(parser.panicMode) return;
-    parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* msg) {
+    if(parser->panicMode) return;
+    parser->panicMode = true;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -70,130 +83,201 @@ static void errorAt(Token* token, const char* msg) {
     }
 
     fprintf(stderr, ": %s\n", msg);
-    parser.hadError = true;
+    parser->hadError = true;
+}
+
+static void error(Parser* parser, const char* msg) {
+    errorAt(parser, &parser->current, msg);
 }
 
-static void error(const char* msg) {
-    errorAt(&parser.current, msg);
+static Token nextToken(Parser* parser) {
+    if (parser->tokens == nullptr) return scanToken(&parser->scanner);
+    const TokenArray* tokens = parser->tokens;
+    if (parser->nextToken < tokens->count) return tokens->tokens[parser->nextToken++];
+
+    // The last token repeats, as it would coming from scanToken(). That
+    // is the EOF or an error, unless running out of memory cut the array
+    // short, in which case the source ends here as far as parsing goes.
+    Token last;
+    last.type = TOKEN_EOF;
+    last.start = "";
+    last.length = 0;
+    last.line = 1;
+    if (tokens->count > 0) {
+        const Token* end = &tokens->tokens[tokens->count - 1];
+        if (end->type == TOKEN_EOF || end->type == TOKEN_ERROR) return *end;
+        last.line = end->line;
+    }
+    return last;
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for(;;) {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
-        error(parser.current.start);
+        parser->current = nextToken(parser);
+        if(parser->current.type != TOKEN_ERROR) break;
+        error(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
-    error(message);
+    error(parser, message);
 }
 
-static void emitByte(uint8_t byte){
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte){
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(std::vector<uint8_t> bytes) {
-    for (auto byte : bytes) {
-        emitByte(byte);
-    }
+static void emitReturn(Parser* parser) {
+    emitByte(parser, OP_RETURN);
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void endCompiler(Parser* parser) {
+    emitReturn(parser);
+    Chunk* chunk = currentChunk(parser);
+    chunk->maxStack = computeMaxStack(chunk);
 }
 
-static void endCompiler() {
-    emitReturn();
-    #ifdef DEBUG_PRINT_CODE
-        if (!parser.hadError) {
-            disassembleChunk(currentChunk(), "code");
-        }
-    #endif
+static void emitConstant(Parser* parser, Value value){
+    writeConstant(currentChunk(parser), value, parser->previous.line);
 }
 
-static std::vector<uint8_t> makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
-        return {
-            OP_CONSTANT_BIG,
-            (uint8_t)((constant >> 16) & 0xFF),
-            (uint8_t)((constant >> 8) & 0xFF),
-            (uint8_t)(constant & 0xFF)
-        };
-    }
-    return {OP_CONSTANT, (uint8_t)constant};
+// Emits the unchecked form of an operator when every operand is proven
+// to be a number, so run() can skip the type checks for it.
+static void emitNumeric(Parser* parser, bool numeric, OpCode checked, OpCode unchecked) {
+    emitByte(parser, numeric ? unchecked : checked);
+}
+
+static void grouping(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void emitConstant(Value value){
-    emitBytes(makeConstant(value));
+// Tokens point into the source, which need not be NUL-terminated (a
+// mapped file ends where the file does), so strtod() gets a copy of just
+// the literal.
+static double tokenNumber(const Token* token) {
+    char buffer[64];
+    if (token->length < (int)sizeof(buffer)) {
+        memcpy(buffer, token->start, token->length);
+        buffer[token->length] = '\0';
+        return strtod(buffer, nullptr);
+    }
+    return strtod(std::string(token->start, token->length).c_str(), nullptr);
 }
 
-static void grouping() {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void number(Parser* parser) {
+    double value = tokenNumber(&parser->previous);
+    emitConstant(parser, NUMBER_VAL(value));
+    parser->exprType = EXPR_NUMBER;
 }
 
-static void number() {
-    double value = strtod(parser.previous.start, nullptr);
-    emitConstant(NUMBER_VAL(value));
+static void column(Parser* parser) {
+    consume(parser, TOKEN_NUMBER, "Expect column number after '$'.");
+    double index = tokenNumber(&parser->previous);
+    if (index > UINT8_MAX || index != (int)index) {
+        errorAt(parser, &parser->previous, "Column number must be an integer from 0 to 255.");
+        return;
+    }
+    emitByte(parser, OP_COLUMN);
+    emitByte(parser, (uint8_t)index);
+    // row-at-a-time callers may bind any value
+    parser->exprType = EXPR_UNKNOWN;
 }
 
-static void unary() {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser) {
+    TokenType operatorType = parser->previous.type;
 
-    expression();
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
+    bool numeric = parser->exprType == EXPR_NUMBER;
 
     switch(operatorType) {
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG:
+            emitByte(parser, OP_NOT);
+            parser->exprType = EXPR_BOOL;
+            break;
+        case TOKEN_MINUS:
+            emitNumeric(parser, numeric, OP_NEGATE, OP_NEGATE_UNCHECKED);
+            parser->exprType = EXPR_NUMBER;
+            break;
         default:
             return;
     }
 }
 
-static void binary() {
-    TokenType operatorType = parser.previous.type;
+// Type an operator leaves behind when it did not raise an error,
+// whatever its operands were.
+static ExprType binaryType(TokenType operatorType) {
+    switch (operatorType) {
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+        case TOKEN_PERCENT:
+        case TOKEN_CARET:
+            return EXPR_NUMBER;
+        case TOKEN_EQUAL_EQUAL:
+        case TOKEN_BANG_EQUAL:
+        case TOKEN_GREATER:
+        case TOKEN_GREATER_EQUAL:
+        case TOKEN_LESS:
+        case TOKEN_LESS_EQUAL:
+            return EXPR_BOOL;
+        default:
+            return EXPR_UNKNOWN;
+    }
+}
+
+static void binary(Parser* parser) {
+    TokenType operatorType = parser->previous.type;
+
+    ExprType leftType = parser->exprType;
 
-    ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    const ParseRule* rule = getRule(operatorType);
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+    bool numeric = leftType == EXPR_NUMBER && parser->exprType == EXPR_NUMBER;
 
     switch (operatorType) {
-        case TOKEN_PLUS:          emitByte(OP_ADD);          break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT);     break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY);     break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE);       break;
-        case TOKEN_PERCENT:       emitByte(OP_MODULO);       break;
-        case TOKEN_CARET:         emitByte(OP_POWER);        break;
-        case TOKEN_SHIFT_LEFT:    emitByte(OP_SHIFT_LEFT);   break;
-        case TOKEN_SHIFT_RIGHT:   emitByte(OP_SHIFT_RIGHT);  break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL);        break;
-        case TOKEN_BANG_EQUAL:    emitByte(OP_NOT_EQUAL);    break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER);      break;
-        case TOKEN_GREATER_EQUAL: emitByte(OP_GREATER_EQUAL);break;
-        case TOKEN_LESS:          emitByte(OP_LESS);         break;
-        case TOKEN_LESS_EQUAL:    emitByte(OP_LESS_EQUAL);   break;
+        case TOKEN_PLUS:          emitNumeric(parser, numeric, OP_ADD, OP_ADD_UNCHECKED);                     break;
+        case TOKEN_MINUS:         emitNumeric(parser, numeric, OP_SUBTRACT, OP_SUBTRACT_UNCHECKED);           break;
+        case TOKEN_STAR:          emitNumeric(parser, numeric, OP_MULTIPLY, OP_MULTIPLY_UNCHECKED);           break;
+        case TOKEN_SLASH:         emitNumeric(parser, numeric, OP_DIVIDE, OP_DIVIDE_UNCHECKED);               break;
+        case TOKEN_PERCENT:       emitNumeric(parser, numeric, OP_MODULO, OP_MODULO_UNCHECKED);               break;
+        case TOKEN_CARET:         emitNumeric(parser, numeric, OP_POWER, OP_POWER_UNCHECKED);                 break;
+        case TOKEN_SHIFT_LEFT:    emitByte(parser, OP_SHIFT_LEFT);                                            break;
+        case TOKEN_SHIFT_RIGHT:   emitByte(parser, OP_SHIFT_RIGHT);                                           break;
+        case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL);                                                 break;
+        case TOKEN_BANG_EQUAL:    emitByte(parser, OP_NOT_EQUAL);                                             break;
+        case TOKEN_GREATER:       emitNumeric(parser, numeric, OP_GREATER, OP_GREATER_UNCHECKED);             break;
+        case TOKEN_GREATER_EQUAL: emitNumeric(parser, numeric, OP_GREATER_EQUAL, OP_GREATER_EQUAL_UNCHECKED); break;
+        case TOKEN_LESS:          emitNumeric(parser, numeric, OP_LESS, OP_LESS_UNCHECKED);                   break;
+        case TOKEN_LESS_EQUAL:    emitNumeric(parser, numeric, OP_LESS_EQUAL, OP_LESS_EQUAL_UNCHECKED);       break;
         default: return;
     }
+    parser->exprType = binaryType(operatorType);
 }
 
-static void literal() {
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_NULL: emitByte(OP_NULL); break;
+static void literal(Parser* parser) {
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitByte(parser, OP_FALSE); parser->exprType = EXPR_BOOL; break;
+        case TOKEN_TRUE: emitByte(parser, OP_TRUE); parser->exprType = EXPR_BOOL; break;
+        case TOKEN_NULL: emitByte(parser, OP_NULL); parser->exprType = EXPR_NULL; break;
         default:
             return;
     }
 }
 
-static std::unordered_map<TokenType, ParseRule> rules = {
+struct RuleEntry {
+    TokenType type;
+    ParseRule rule;
+};
+
+static constexpr RuleEntry ruleEntries[] = {
     // Single-character tokens
     {TOKEN_LEFT_PAREN,    {grouping, nullptr, PREC_NONE}},
     {TOKEN_RIGHT_PAREN,   {nullptr,  nullptr, PREC_NONE}},
@@ -212,7 +296,7 @@ static std::unordered_map<TokenType, ParseRule> rules = {
     {TOKEN_PERCENT,       {nullptr,  binary,  PREC_FACTOR}},
     {TOKEN_QMARK,         {nullptr,  nullptr, PREC_NONE}},
     {TOKEN_COLON,         {nullptr,  nullptr, PREC_NONE}},
-    {TOKEN_DOLSIGN,       {nullptr,  nullptr, PREC_NONE}},
+    {TOKEN_DOLSIGN,       {column,   nullptr, PREC_NONE}},
     // One or two character tokens
     {TOKEN_PLUS_PLUS,         {nullptr, nullptr, PREC_NONE}},
     {TOKEN_MINUS_MINUS,       {nullptr, nullptr, PREC_NONE}},
@@ -272,37 +356,84 @@ static std::unordered_map<TokenType, ParseRule> rules = {
     {TOKEN_EOF,   {nullptr, nullptr, PREC_NONE}},
 };
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+#define TOKEN_COUNT (TOKEN_EOF + 1)
+
+static_assert(sizeof(ruleEntries) / sizeof(ruleEntries[0]) == TOKEN_COUNT,
+              "every TokenType needs a parse rule");
+
+// The entries above are flattened into an array indexed by TokenType at
+// compile time. It is never written afterwards, so every thread can share
+// it without locking.
+struct RuleTable {
+    ParseRule rules[TOKEN_COUNT];
+};
+
+static constexpr RuleTable buildRules() {
+    RuleTable table{};
+    for (const RuleEntry& entry : ruleEntries) {
+        table.rules[entry.type] = entry.rule;
+    }
+    return table;
+}
+
+static constexpr RuleTable rules = buildRules();
+
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    parser->exprType = EXPR_UNKNOWN;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == nullptr) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
-    prefixRule();
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+    prefixRule(parser);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser);
     }
 }
 
-static ParseRule* getRule(TokenType type) {
-    return &rules[type];
+static const ParseRule* getRule(TokenType type) {
+    return &rules.rules[type];
+}
+
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
+}
+
+static bool compileTokens(Parser* parser, Chunk* chunk) {
+    parser->compilingChunk = chunk;
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->exprType = EXPR_UNKNOWN;
+    advance(parser);
+    expression(parser);
+    consume(parser, TOKEN_EOF, "Expect end of expression.");
+    endCompiler(parser);
+    return !parser->hadError;
 }
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+bool compile(const char* source, size_t length, Chunk* chunk){
+    Parser parser;
+    initScanner(&parser.scanner, source, length);
+    parser.tokens = nullptr;
+    return compileTokens(&parser, chunk);
 }
 
-bool compile(const char* source, Chunk* chunk){
-    initScanner(source);
-    compilingChunk = chunk;
-    parser.hadError = false;
-    parser.panicMode = false;
-    advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
-    endCompiler();
-    return !parser.hadError;
+bool compileParallel(const char* source, size_t length, Chunk* chunk, int threads) {
+    // The tokens are gone again by the end of this call, so they come
+    // from the heap rather than from an arena the chunk is built in.
+    TokenArray tokens;
+    initTokenArray(&tokens);
+    Allocator* previous = useAllocator(&heapAllocator);
+    scanAll(source, length, threads, &tokens);
+    useAllocator(previous);
+
+    Parser parser;
+    parser.tokens = &tokens;
+    parser.nextToken = 0;
+    bool compiled = compileTokens(&parser, chunk);
+    freeTokenArray(&tokens);
+    return compiled;
 }
\ No newline at end of file
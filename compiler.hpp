@@ -3,4 +3,9 @@
 #include "common.hpp"
 #include "vm.hpp"
 
-bool compile(const char* source, Chunk *chunk);
\ No newline at end of file
+// `source` holds `length` bytes and needs no terminator.
+bool compile(const char* source, size_t length, Chunk *chunk);
+// Same result as compile(), byte for byte, but the source is scanned on
+// up to `threads` threads first. Parsing the single expression stays
+// serial. Only pays off for sources of several megabytes.
+bool compileParallel(const char* source, size_t length, Chunk* chunk, int threads);
\ No newline at end of file
@@ -1,83 +1,243 @@
 #include <cstdio>
+#include <cstdarg>
 #include "debug.hpp"
 #include "value.hpp"
 
-void disassembleChunk(Chunk *chunk, const char *name)
+void initTraceSink(TraceSink *sink, FILE *out)
 {
-    printf("== %s ==\n", name);
+    sink->out = out;
+    sink->length = 0;
+}
+
+void flushTraceSink(TraceSink *sink)
+{
+    fwrite(sink->buffer, 1, sink->length, sink->out);
+    fflush(sink->out);
+    sink->length = 0;
+}
+
+void traceWrite(TraceSink *sink, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    va_list retry;
+    va_copy(retry, args);
+
+    size_t space = TRACE_BUFFER_SIZE - sink->length;
+    int written = vsnprintf(sink->buffer + sink->length, space, format, args);
+    if (written >= 0 && (size_t)written >= space)
+    {
+        // did not fit, make room and format again
+        flushTraceSink(sink);
+        written = vsnprintf(sink->buffer, TRACE_BUFFER_SIZE, format, retry);
+        if (written >= TRACE_BUFFER_SIZE)
+            written = TRACE_BUFFER_SIZE - 1;
+    }
+    if (written > 0)
+        sink->length += written;
+
+    va_end(retry);
+    va_end(args);
+}
+
+void traceValue(TraceSink *sink, Value value)
+{
+    char buffer[64];
+    formatValue(buffer, sizeof(buffer), value);
+    traceWrite(sink, "%s", buffer);
+}
+
+void disassembleChunk(const Chunk *chunk, const char *name)
+{
+    TraceSink sink;
+    initTraceSink(&sink, stdout);
+    traceWrite(&sink, "== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;)
     {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(&sink, chunk, offset);
     }
+    flushTraceSink(&sink);
 }
 
-static int simpleInstruction(const char *name, int offset)
+static int simpleInstruction(TraceSink *sink, const char *name, int offset)
 {
-    printf(" %s\n", name);
+    traceWrite(sink, " %s\n", name);
     return offset + 1;
 }
 
-static int constantInstructionSmall(const char *name, Chunk *chunk, int offset)
+static int constantInstructionSmall(TraceSink *sink, const char *name, const Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    traceWrite(sink, "%-16s %4d '", name, constant);
+    traceValue(sink, chunk->constants.values[constant]);
+    traceWrite(sink, "'\n");
     return offset + 2;
 }
 
-static int constantInstructionBig(const char *name, Chunk *chunk, int offset)
+static int constantInstructionBig(TraceSink *sink, const char *name, const Chunk *chunk, int offset)
 {
     uint8_t constant_low  = chunk->code[offset + 3];
     uint8_t constant_mid  = chunk->code[offset + 2];
     uint8_t constant_high = chunk->code[offset + 1];
     uint32_t constant = ((constant_high << 16) | (constant_mid << 8) | (constant_low));
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    traceWrite(sink, "%-16s %4d '", name, constant);
+    traceValue(sink, chunk->constants.values[constant]);
+    traceWrite(sink, "'\n");
     return offset + 4;
 }
 
-int disassembleInstruction(Chunk *chunk, int offset)
+static int immediateInstruction(TraceSink *sink, const char *name, const Chunk *chunk, int offset)
 {
-    printf("%04d", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    uint8_t op = chunk->code[offset];
+    double value;
+    int length;
+    if (op == OP_INT8)
     {
-        printf(" | ");
+        value = (int8_t)chunk->code[offset + 1];
+        length = 2;
     }
     else
     {
-        printf("%4d ", chunk->lines[offset]);
+        int16_t immediate = (int16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        value = op == OP_FIXED16 ? immediate / 256.0 : immediate;
+        length = 3;
     }
-    uint8_t instruction = chunk->code[offset];
-    switch (instruction)
+    traceWrite(sink, "%-16s      '%g'\n", name, value);
+    return offset + length;
+}
+
+static int byteInstruction(TraceSink *sink, const char *name, const Chunk *chunk, int offset)
+{
+    traceWrite(sink, "%-16s %4d\n", name, chunk->code[offset + 1]);
+    return offset + 2;
+}
+
+static const char unknownOpcodeName[] = "OP_UNKNOWN";
+
+// The name disassembleInstruction() prints for op.
+const char *opcodeName(uint8_t op)
+{
+    switch (op)
     {
     case OP_RETURN:
-        return simpleInstruction("OP_RETURN", offset);
+        return "OP_RETURN";
     case OP_CONSTANT:
-        return constantInstructionSmall("OP_CONSTANT", chunk, offset);
+        return "OP_CONSTANT";
     case OP_CONSTANT_BIG:
-        return constantInstructionBig("OP_CONSTANT_BIG", chunk, offset);
+        return "OP_CONSTANT_BIG";
+    case OP_INT8:
+        return "OP_INT8";
+    case OP_INT16:
+        return "OP_INT16";
+    case OP_FIXED16:
+        return "OP_FIXED16";
     case OP_NEGATE:
-        return simpleInstruction("OP_NEGATE", offset);
+        return "OP_NEGATE";
     case OP_ADD:
-        return simpleInstruction("OP_ADD", offset);
+        return "OP_ADD";
     case OP_SUBTRACT:
-        return simpleInstruction("OP_SUBTRACT", offset);
+        return "OP_SUBTRACT";
     case OP_MULTIPLY:
-        return simpleInstruction("OP_MULTIPLY", offset);
+        return "OP_MULTIPLY";
     case OP_DIVIDE:
-        return simpleInstruction("OP_DIVIDE", offset);
+        return "OP_DIVIDE";
+    case OP_MODULO:
+        return "OP_MODULO";
     case OP_POWER:
-        return simpleInstruction("OP_RAISETOPOWER", offset);
+        return "OP_RAISETOPOWER";
+    case OP_SHIFT_LEFT:
+        return "OP_SHIFT_LEFT";
+    case OP_SHIFT_RIGHT:
+        return "OP_SHIFT_RIGHT";
+    case OP_EQUAL:
+        return "OP_EQUAL";
+    case OP_NOT_EQUAL:
+        return "OP_NOT_EQUAL";
+    case OP_GREATER:
+        return "OP_GREATER";
+    case OP_GREATER_EQUAL:
+        return "OP_GREATER_EQUAL";
+    case OP_LESS:
+        return "OP_LESS";
+    case OP_LESS_EQUAL:
+        return "OP_LESS_EQUAL";
+    case OP_NOT:
+        return "OP_NOT";
+    case OP_ADD_NUM:
+        return "OP_ADD_NUM";
+    case OP_SUBTRACT_NUM:
+        return "OP_SUBTRACT_NUM";
+    case OP_MULTIPLY_NUM:
+        return "OP_MULTIPLY_NUM";
+    case OP_DIVIDE_NUM:
+        return "OP_DIVIDE_NUM";
+    case OP_NEGATE_UNCHECKED:
+        return "OP_NEGATE_UNCHECKED";
+    case OP_ADD_UNCHECKED:
+        return "OP_ADD_UNCHECKED";
+    case OP_SUBTRACT_UNCHECKED:
+        return "OP_SUBTRACT_UNCHECKED";
+    case OP_MULTIPLY_UNCHECKED:
+        return "OP_MULTIPLY_UNCHECKED";
+    case OP_DIVIDE_UNCHECKED:
+        return "OP_DIVIDE_UNCHECKED";
+    case OP_MODULO_UNCHECKED:
+        return "OP_MODULO_UNCHECKED";
+    case OP_POWER_UNCHECKED:
+        return "OP_POWER_UNCHECKED";
+    case OP_GREATER_UNCHECKED:
+        return "OP_GREATER_UNCHECKED";
+    case OP_GREATER_EQUAL_UNCHECKED:
+        return "OP_GREATER_EQUAL_UNCHECKED";
+    case OP_LESS_UNCHECKED:
+        return "OP_LESS_UNCHECKED";
+    case OP_LESS_EQUAL_UNCHECKED:
+        return "OP_LESS_EQUAL_UNCHECKED";
     case OP_NULL:
-        return simpleInstruction("OP_NULL", offset);
+        return "OP_NULL";
     case OP_TRUE:
-        return simpleInstruction("OP_TRUE", offset);
+        return "OP_TRUE";
     case OP_FALSE:
-        return simpleInstruction("OP_FALSE", offset);
+        return "OP_FALSE";
+    case OP_COLUMN:
+        return "OP_COLUMN";
+    default:
+        return unknownOpcodeName;
+    }
+}
+
+int disassembleInstruction(TraceSink *sink, const Chunk *chunk, int offset)
+{
+    traceWrite(sink, "%04d", offset);
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
+    {
+        traceWrite(sink, " | ");
+    }
+    else
+    {
+        traceWrite(sink, "%4d ", line);
+    }
+    uint8_t instruction = loadOpcode(chunk->code + offset);
+    const char *name = opcodeName(instruction);
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+        return constantInstructionSmall(sink, name, chunk, offset);
+    case OP_CONSTANT_BIG:
+        return constantInstructionBig(sink, name, chunk, offset);
+    case OP_INT8:
+    case OP_INT16:
+    case OP_FIXED16:
+        return immediateInstruction(sink, name, chunk, offset);
+    case OP_COLUMN:
+        return byteInstruction(sink, name, chunk, offset);
     default:
-        printf("Unknown opcode %d\n", instruction);
-        return offset + 1;
+        if (name == unknownOpcodeName)
+        {
+            traceWrite(sink, "Unknown opcode %d\n", instruction);
+            return offset + 1;
+        }
+        return simpleInstruction(sink, name, offset);
     }
 }
\ No newline at end of file
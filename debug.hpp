@@ -1,6 +1,24 @@
 #pragma once
 
+#include <cstdio>
 #include "chunk.hpp"
 
-void disassembleChunk(Chunk *chunk, const char *name);
-int disassembleInstruction(Chunk *chunk, int offset);
\ No newline at end of file
+#define TRACE_BUFFER_SIZE 65536
+
+// Collects disassembly and trace text in memory and hands it to `out` in
+// large writes instead of one printf per token.
+struct TraceSink
+{
+    FILE *out;
+    size_t length;
+    char buffer[TRACE_BUFFER_SIZE];
+};
+
+void initTraceSink(TraceSink *sink, FILE *out);
+void flushTraceSink(TraceSink *sink);
+void traceWrite(TraceSink *sink, const char *format, ...);
+void traceValue(TraceSink *sink, Value value);
+
+void disassembleChunk(const Chunk *chunk, const char *name);
+int disassembleInstruction(TraceSink *sink, const Chunk *chunk, int offset);
+const char *opcodeName(uint8_t op);
\ No newline at end of file
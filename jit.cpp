@@ -0,0 +1,474 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "jit.hpp"
+#include "memory.hpp"
+#include "selftest.hpp"
+#include "vm.hpp"
+
+#ifdef JIT_X64
+
+#include <sys/mman.h>
+
+typedef int (*NativeFn)(Value **stackTop);
+
+struct NativeCode
+{
+    void *memory;
+    size_t size;
+    NativeFn entry;
+};
+
+// Register use inside native code:
+//   rbx  stackTop, the next free slot
+//   r12  the caller's Value** stackTop, written back on exit
+//   r13  QNAN, for the IS_NUMBER tests
+// All three are callee-saved, so they survive the helper calls, and the
+// three pushes in the prologue leave rsp 16-byte aligned for those calls.
+
+struct Assembler
+{
+    std::vector<uint8_t> code;
+    // position of each rel32 that jumps to the exit for a bytecode offset
+    std::vector<std::pair<size_t, int>> bails;
+};
+
+static void emit(Assembler *as, std::initializer_list<uint8_t> bytes)
+{
+    as->code.insert(as->code.end(), bytes);
+}
+
+static void emit32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        as->code.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        as->code.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Assembler *as, size_t position, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        as->code[position + i] = (uint8_t)(value >> (8 * i));
+}
+
+static void prologue(Assembler *as)
+{
+    emit(as, {0x53});             // push rbx
+    emit(as, {0x41, 0x54});       // push r12
+    emit(as, {0x41, 0x55});       // push r13
+    emit(as, {0x49, 0x89, 0xFC}); // mov r12, rdi
+    emit(as, {0x48, 0x8B, 0x1F}); // mov rbx, [rdi]
+    emit(as, {0x49, 0xBD});       // mov r13, QNAN
+    emit64(as, QNAN);
+}
+
+// Hands `offset` back to the caller as the place to resume interpreting.
+static void exitAt(Assembler *as, int offset)
+{
+    emit(as, {0xB8}); // mov eax, offset
+    emit32(as, (uint32_t)offset);
+    emit(as, {0x49, 0x89, 0x1C, 0x24}); // mov [r12], rbx
+    emit(as, {0x41, 0x5D});             // pop r13
+    emit(as, {0x41, 0x5C});             // pop r12
+    emit(as, {0x5B});                   // pop rbx
+    emit(as, {0xC3});                   // ret
+}
+
+static void pushValue(Assembler *as, Value value)
+{
+    emit(as, {0x48, 0xB8}); // mov rax, value
+    emit64(as, value);
+    emit(as, {0x48, 0x89, 0x03});       // mov [rbx], rax
+    emit(as, {0x48, 0x83, 0xC3, 0x08}); // add rbx, 8
+}
+
+static void dropOne(Assembler *as)
+{
+    emit(as, {0x48, 0x83, 0xEB, 0x08}); // sub rbx, 8
+}
+
+// Leaves through the exit for `offset` unless the slot at rbx + disp
+// holds a number, so run() re-executes the instruction and reports the
+// error exactly as it would have without the JIT.
+static void checkNumber(Assembler *as, int8_t disp, int offset)
+{
+    emit(as, {0x48, 0x8B, 0x43, (uint8_t)disp}); // mov rax, [rbx + disp]
+    emit(as, {0x4C, 0x21, 0xE8});                // and rax, r13
+    emit(as, {0x4C, 0x39, 0xE8});                // cmp rax, r13
+    emit(as, {0x0F, 0x84});                      // je exit
+    as->bails.push_back({as->code.size(), offset});
+    emit32(as, 0);
+}
+
+static void checkNumbers(Assembler *as, int offset)
+{
+    checkNumber(as, -16, offset);
+    checkNumber(as, -8, offset);
+}
+
+// sseOp is the second opcode byte of addsd, subsd, mulsd or divsd
+static void arithmetic(Assembler *as, uint8_t sseOp)
+{
+    emit(as, {0xF2, 0x0F, 0x10, 0x43, 0xF0});  // movsd xmm0, [rbx-16]
+    emit(as, {0xF2, 0x0F, sseOp, 0x43, 0xF8}); // op xmm0, [rbx-8]
+    emit(as, {0xF2, 0x0F, 0x11, 0x43, 0xF0});  // movsd [rbx-16], xmm0
+    dropOne(as);
+}
+
+// a > b is `seta` after ucomisd a, b and a >= b is `setae`; both are false
+// on unordered operands, matching C. < and <= swap the operands.
+static void comparison(Assembler *as, bool swap, uint8_t setcc)
+{
+    uint8_t first = swap ? 0xF8 : 0xF0;
+    uint8_t second = swap ? 0xF0 : 0xF8;
+    emit(as, {0xF2, 0x0F, 0x10, 0x43, first});  // movsd xmm0, [rbx+first]
+    emit(as, {0x66, 0x0F, 0x2E, 0x43, second}); // ucomisd xmm0, [rbx+second]
+    emit(as, {0x0F, setcc, 0xC0});              // setcc al
+    emit(as, {0x0F, 0xB6, 0xC0});               // movzx eax, al
+    emit(as, {0x48, 0xB9});                     // mov rcx, FALSE_VAL
+    emit64(as, FALSE_VAL);
+    emit(as, {0x48, 0x09, 0xC8});       // or rax, rcx (TRUE_VAL is FALSE_VAL | 1)
+    emit(as, {0x48, 0x89, 0x43, 0xF0}); // mov [rbx-16], rax
+    dropOne(as);
+}
+
+static void negate(Assembler *as)
+{
+    emit(as, {0x48, 0x8B, 0x43, 0xF8});       // mov rax, [rbx-8]
+    emit(as, {0x48, 0x0F, 0xBA, 0xF8, 0x3F}); // btc rax, 63
+    emit(as, {0x48, 0x89, 0x43, 0xF8});       // mov [rbx-8], rax
+}
+
+// The less common operations call back into C++ with stackTop.
+static void nativeEqual(Value *top)
+{
+    top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1]));
+}
+
+static void nativeNotEqual(Value *top)
+{
+    top[-2] = BOOL_VAL(!valuesEqual(top[-2], top[-1]));
+}
+
+static void nativeNot(Value *top)
+{
+    top[-1] = BOOL_VAL(isFalsey(top[-1]));
+}
+
+static void nativeModulo(Value *top)
+{
+    top[-2] = NUMBER_VAL(fmod(AS_NUMBER(top[-2]), AS_NUMBER(top[-1])));
+}
+
+static void nativePower(Value *top)
+{
+    top[-2] = NUMBER_VAL(pow(AS_NUMBER(top[-2]), AS_NUMBER(top[-1])));
+}
+
+static void callHelper(Assembler *as, void (*helper)(Value *))
+{
+    emit(as, {0x48, 0x89, 0xDF}); // mov rdi, rbx
+    emit(as, {0x48, 0xB8});       // mov rax, helper
+    emit64(as, (uint64_t)(uintptr_t)helper);
+    emit(as, {0xFF, 0xD0}); // call rax
+}
+
+// Translates instructions until the first one it cannot run natively.
+// The code has no jumps, so everything after that point is interpreted.
+static void translate(Assembler *as, const Chunk *chunk)
+{
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t op = chunk->code[offset];
+        const uint8_t *operand = chunk->code + offset + 1;
+        switch (op)
+        {
+        case OP_CONSTANT:
+            pushValue(as, chunk->constants.values[operand[0]]);
+            break;
+        case OP_CONSTANT_BIG:
+            pushValue(as, chunk->constants.values[(operand[0] << 16) | (operand[1] << 8) | operand[2]]);
+            break;
+        case OP_INT8:
+            pushValue(as, NUMBER_VAL((int8_t)operand[0]));
+            break;
+        case OP_INT16:
+            pushValue(as, NUMBER_VAL((int16_t)((operand[0] << 8) | operand[1])));
+            break;
+        case OP_FIXED16:
+            pushValue(as, NUMBER_VAL((int16_t)((operand[0] << 8) | operand[1]) / 256.0));
+            break;
+        case OP_NULL:
+            pushValue(as, NULL_VAL);
+            break;
+        case OP_TRUE:
+            pushValue(as, TRUE_VAL);
+            break;
+        case OP_FALSE:
+            pushValue(as, FALSE_VAL);
+            break;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_ADD_UNCHECKED:
+            arithmetic(as, 0x58);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_SUBTRACT_UNCHECKED:
+            arithmetic(as, 0x5C);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_MULTIPLY_UNCHECKED:
+            arithmetic(as, 0x59);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_DIVIDE_UNCHECKED:
+            arithmetic(as, 0x5E);
+            break;
+        case OP_MODULO:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_MODULO_UNCHECKED:
+            callHelper(as, nativeModulo);
+            dropOne(as);
+            break;
+        case OP_POWER:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_POWER_UNCHECKED:
+            callHelper(as, nativePower);
+            dropOne(as);
+            break;
+
+        case OP_GREATER:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_GREATER_UNCHECKED:
+            comparison(as, false, 0x97);
+            break;
+        case OP_GREATER_EQUAL:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_GREATER_EQUAL_UNCHECKED:
+            comparison(as, false, 0x93);
+            break;
+        case OP_LESS:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_LESS_UNCHECKED:
+            comparison(as, true, 0x97);
+            break;
+        case OP_LESS_EQUAL:
+            checkNumbers(as, offset);
+            // fall through
+        case OP_LESS_EQUAL_UNCHECKED:
+            comparison(as, true, 0x93);
+            break;
+
+        case OP_NEGATE:
+            checkNumber(as, -8, offset);
+            // fall through
+        case OP_NEGATE_UNCHECKED:
+            negate(as);
+            break;
+        case OP_NOT:
+            callHelper(as, nativeNot);
+            break;
+        case OP_EQUAL:
+            callHelper(as, nativeEqual);
+            dropOne(as);
+            break;
+        case OP_NOT_EQUAL:
+            callHelper(as, nativeNotEqual);
+            dropOne(as);
+            break;
+
+        default:
+            // OP_RETURN, and anything run() should deal with itself
+            exitAt(as, offset);
+            return;
+        }
+        offset += opcodeLength(op);
+    }
+    exitAt(as, chunk->count);
+}
+
+NativeCode *compileNative(const Chunk *chunk)
+{
+    Assembler as;
+    prologue(&as);
+    translate(&as, chunk);
+
+    // one exit stub per failing instruction, shared by its operand checks
+    int stubOffset = -1;
+    size_t stubStart = 0;
+    for (const std::pair<size_t, int> &bail : as.bails)
+    {
+        if (bail.second != stubOffset)
+        {
+            stubOffset = bail.second;
+            stubStart = as.code.size();
+            exitAt(&as, stubOffset);
+        }
+        patch32(&as, bail.first, (uint32_t)(stubStart - (bail.first + 4)));
+    }
+
+    size_t size = as.code.size();
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+    memcpy(memory, as.code.data(), size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    NativeCode *native = ALLOCATE(MEMORY_CODE, NativeCode, 1);
+    if (native == nullptr)
+    {
+        munmap(memory, size);
+        return nullptr;
+    }
+    native->memory = memory;
+    native->size = size;
+    native->entry = (NativeFn)memory;
+    return native;
+}
+
+int runNative(const NativeCode *native, Value **stackTop)
+{
+    return native->entry(stackTop);
+}
+
+void freeNative(NativeCode *native)
+{
+    if (native == nullptr)
+        return;
+    munmap(native->memory, native->size);
+    FREE(MEMORY_CODE, NativeCode, native);
+}
+
+static bool sameValue(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b) && std::isnan(AS_NUMBER(a)) && std::isnan(AS_NUMBER(b)))
+        return true;
+    return a == b;
+}
+
+// Runs the program once interpreted and once native.
+static bool crossCheck(VM *vm, Program *program, const std::string &source, const char *variant)
+{
+    NativeCode *native = compileNative(&program->chunk);
+    if (native == nullptr)
+    {
+        printf("jit: could not compile \"%s\"\n", source.c_str());
+        return false;
+    }
+
+    Value expected = NULL_VAL;
+    Value actual = NULL_VAL;
+    program->native = nullptr;
+    InterpretResult expectedStatus = execute(vm, program, &expected);
+    program->native = native;
+    InterpretResult actualStatus = execute(vm, program, &actual);
+    program->native = nullptr;
+    freeNative(native);
+
+    if (expectedStatus == actualStatus && (expectedStatus != INTERPRET_OK || sameValue(expected, actual)))
+        return true;
+
+    printf("jit: mismatch (%s) on \"%s\"\n  interpreter: status %d, ", variant, source.c_str(), expectedStatus);
+    printValue(expected);
+    printf("\n  native:      status %d, ", actualStatus);
+    printValue(actual);
+    printf("\n");
+    return false;
+}
+
+bool jitSelfTest(int count, unsigned seed)
+{
+    VM vm;
+    initVM(&vm);
+    // folding would reduce every program to a single constant
+    vm.optimize = false;
+    unsigned state = seed != 0 ? seed : 1;
+
+    int savedStderr = silenceStderr();
+
+    bool ok = true;
+    int checked = 0;
+    for (; checked < count && ok; checked++)
+    {
+        std::string source;
+        randomExpression(&source, &state, 1 + (int)(nextRandom(&state) % 6));
+
+        Program *program = prepare(&vm, source.c_str(), source.size());
+        if (program == nullptr)
+            continue;
+        ok = crossCheck(&vm, program, source, "as compiled");
+
+        // again with every specialized opcode turned back into its
+        // generic, type-checked form
+        for (int offset = 0; ok && offset < program->chunk.count; offset += opcodeLength(program->chunk.code[offset]))
+            program->chunk.code[offset] = genericOpcode(program->chunk.code[offset]);
+        if (ok)
+            ok = crossCheck(&vm, program, source, "generic");
+        freeProgram(program);
+    }
+
+    restoreStderr(savedStderr);
+    freeVM(&vm);
+
+    if (ok)
+        printf("jit: %d random expressions agree (seed %u)\n", checked, seed);
+    return ok;
+}
+
+#else
+
+struct NativeCode
+{
+    int unused;
+};
+
+NativeCode *compileNative(const Chunk *)
+{
+    return nullptr;
+}
+
+int runNative(const NativeCode *, Value **)
+{
+    return 0;
+}
+
+void freeNative(NativeCode *)
+{
+}
+
+bool jitSelfTest(int, unsigned)
+{
+    printf("jit: not available in this build\n");
+    return false;
+}
+
+#endif
\ No newline at end of file
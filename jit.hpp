@@ -0,0 +1,23 @@
+#pragma once
+
+#include "chunk.hpp"
+
+// Baseline JIT: translates a chunk into x86-64 machine code that works on
+// the VM's own operand stack. Native code never reports errors itself; on
+// an opcode it does not handle, on an operand of the wrong type and at
+// OP_RETURN it stops and hands back the offset of that instruction, and
+// run() carries on from there with the stack exactly as the native code
+// left it.
+struct NativeCode;
+
+// Returns nullptr when the JIT is not available for this platform or
+// Value layout, in which case the chunk is simply interpreted.
+NativeCode *compileNative(const Chunk *chunk);
+// Runs the native code against the stack ending at *stackTop and returns
+// the bytecode offset to resume interpreting at.
+int runNative(const NativeCode *native, Value **stackTop);
+void freeNative(NativeCode *native);
+
+// Compiles `count` random expressions and checks that the JIT and the
+// interpreter agree on every one. Prints the first mismatch.
+bool jitSelfTest(int count, unsigned seed);
\ No newline at end of file
@@ -3,13 +3,24 @@
 #include "debug.hpp"
 #include "value.hpp"
 #include "vm.hpp"
+#include "cache.hpp"
+#include "jit.hpp"
+#include "aot.hpp"
+#include "batch.hpp"
+#include "bench.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string>
+#include <vector>
 #include <iostream>
 #include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -18,11 +29,11 @@ static void repl() {
             break;
         }
         if (strncmp(line, "exit", 4) == 0) break;
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
-static char* readFile(const char* path) {
+static char* readFile(const char* path, size_t* length) {
     FILE* file = fopen(path, "rb");
 
     if (file == nullptr) {
@@ -48,28 +59,289 @@ static char* readFile(const char* path) {
 
     buffer[bytesRead] = '\0';
     fclose(file);
+    *length = bytesRead;
     return buffer;
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+// A script's text. Regular files are mapped read-only and scanned where
+// they are, without a copy or a terminator; anything that cannot be
+// mapped is read with readFile() instead.
+struct SourceFile {
+    const char* text;
+    size_t length;
+    // the mapping to unmap, or null if text came from readFile()
+    void* mapping;
+};
+
+static SourceFile openSource(const char* path) {
+    SourceFile source;
+    source.mapping = nullptr;
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+            source.text = (const char*)data;
+            source.length = (size_t)info.st_size;
+            source.mapping = data;
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (source.mapping == nullptr) source.text = readFile(path, &source.length);
+    return source;
+}
+
+static void closeSource(SourceFile* source) {
+    if (source->mapping != nullptr) {
+        munmap(source->mapping, source->length);
+    } else {
+        free((char*)source->text);
+    }
+}
+
+// --cache: load and save compiled programs next to their source
+static bool useCache = false;
+static bool showMemoryStats = false;
+// where --profile and --sample write collapsed stacks, or null
+static const char* profilePath = nullptr;
+static const char* samplePath = nullptr;
+
+// Prints what a profiler gathered while running and writes its
+// collapsed stacks to path.
+template <typename Profiler>
+static void reportProfile(const Profiler* profiler, const char* path,
+                          void (*print)(const Profiler*, FILE*),
+                          bool (*writeCollapsed)(const Profiler*, FILE*)) {
+    print(profiler, stderr);
+    FILE* out = fopen(path, "w");
+    if (out == nullptr) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return;
+    }
+    bool ok = writeCollapsed(profiler, out);
+    if (fclose(out) != 0 || !ok) fprintf(stderr, "Could not write file \"%s\".\n", path);
+}
+
+static void runFile(VM* vm, const char* path) {
+    SourceFile source = openSource(path);
+    Program* program;
+    // a cached program skips the compiler, so whatever reports on compiling
+    // needs it compiled afresh
+    bool compileReports = vm->printCode || vm->printOptimizerStats || vm->printArenaStats;
+    if (useCache && !compileReports) {
+        uint64_t sourceHash = hashSource(source.text, source.length);
+        uint32_t flags = vm->optimize ? CACHE_OPTIMIZED : 0;
+        std::string cachePath = std::string(path) + ".iffc";
+        program = loadCachedProgram(vm, cachePath.c_str(), sourceHash, flags);
+        if (program == nullptr) {
+            program = prepare(vm, source.text, source.length);
+            if (program != nullptr) saveCachedProgram(cachePath.c_str(), program, sourceHash, flags);
+        }
+    } else {
+        program = prepare(vm, source.text, source.length);
+    }
+    closeSource(&source);
+
+    InterpretResult result;
+    if (program == nullptr) {
+        result = vm->memory.exhausted ? INTERPRET_RUNTIME_ERROR : INTERPRET_COMPILE_ERROR;
+    } else {
+        result = interpretProgram(vm, program);
+        // the reports read the program's line table
+        if (vm->profile != nullptr) {
+            reportProfile(vm->profile, profilePath, printProfile, writeCollapsedProfile);
+        } else if (vm->sampler != nullptr) {
+            reportProfile(vm->sampler, samplePath, printSamples, writeCollapsedSamples);
+        }
+        freeProgram(program);
+    }
+    if (showMemoryStats) printMemoryStats(&vm->memory, stderr);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Compiles the script and writes it out as C++ instead of running it.
+static void emitFile(VM* vm, const char* path, const char* outPath) {
+    SourceFile source = openSource(path);
+    Program* program = prepare(vm, source.text, source.length);
+    closeSource(&source);
+    if (program == nullptr) exit(65);
+
+    FILE* out = fopen(outPath, "w");
+    if (out == nullptr) {
+        fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+        exit(74);
+    }
+    bool ok = emitCpp(&program->chunk, path, out);
+    ok = fclose(out) == 0 && ok;
+    freeProgram(program);
+    if (!ok) {
+        fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+        exit(74);
+    }
+}
+
+// Reads comma-separated numbers, one row per line, into one vector per
+// column.
+static std::vector<std::vector<double>> readColumns(const char* path) {
+    size_t length;
+    char* text = readFile(path, &length);
+    std::vector<std::vector<double>> columns;
+    size_t row = 0;
+    for (char* line = text; *line != '\0';) {
+        char* end = strchr(line, '\n');
+        if (end == nullptr) end = line + strlen(line);
+        if (end > line && end[-1] == '\r') end[-1] = '\0';
+        bool last = *end == '\0';
+        *end = '\0';
+
+        if (*line != '\0') {
+            size_t column = 0;
+            for (char* field = line;; column++) {
+                char* next;
+                double value = strtod(field, &next);
+                if (next == field) {
+                    fprintf(stderr, "Row %zu of \"%s\": expected a number.\n", row, path);
+                    exit(65);
+                }
+                if (row == 0) columns.emplace_back();
+                if (column >= columns.size()) break;
+                columns[column].push_back(value);
+                while (*next == ' ' || *next == '\t') next++;
+                if (*next != ',') break;
+                field = next + 1;
+            }
+            if (column + 1 != columns.size()) {
+                fprintf(stderr, "Row %zu of \"%s\" has %zu columns, expected %zu.\n",
+                        row, path, column + 1, columns.size());
+                exit(65);
+            }
+            row++;
+        }
+        if (last) break;
+        line = end + 1;
+    }
+    free(text);
+    return columns;
+}
+
+// Evaluates the script once for every row of a CSV file.
+static void batchFile(VM* vm, const char* path, const char* dataPath) {
+    SourceFile source = openSource(path);
+    Program* program = prepare(vm, source.text, source.length);
+    closeSource(&source);
+    if (program == nullptr) exit(65);
+
+    std::vector<std::vector<double>> columns = readColumns(dataPath);
+    std::vector<const double*> columnData;
+    for (const std::vector<double>& column : columns) columnData.push_back(column.data());
+    size_t rowCount = columns.empty() ? 0 : columns[0].size();
+
+    std::vector<Value> results(rowCount);
+    InterpretResult result = executeBatch(program, columnData.data(), (int)columnData.size(),
+                                          rowCount, results.data());
+    freeProgram(program);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+
+    for (Value value : results) {
+        printValue(value);
+        printf("\n");
+    }
+}
+
+static bool envFlag(const char* name) {
+    const char* value = getenv(name);
+    return value != nullptr && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: Ioapp [--trace] [--print-code] [--no-optimize] [--opt-stats] [--arena-stats] [--mem-stats] [--mem-limit bytes] [--profile out.folded] [--sample out.folded] [--sample-interval us] [--cache] [--no-cache] [--jit] [--jit-selftest] [--emit-cpp out.cpp] [--aot-selftest] [--bench name] [--batch data.csv] [--compile-threads n] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
-    initVM();
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    VM vm;
+    initVM(&vm);
+    vm.traceExecution = envFlag("IFF_TRACE");
+    vm.printCode = envFlag("IFF_PRINT_CODE");
+    const char* path = nullptr;
+    const char* emitPath = nullptr;
+    const char* batchPath = nullptr;
+    long sampleInterval = SAMPLE_INTERVAL_MICROS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-optimize") == 0) {
+            vm.optimize = false;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            vm.traceExecution = true;
+        } else if (strcmp(argv[i], "--print-code") == 0) {
+            vm.printCode = true;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            useCache = true;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            useCache = false;
+        } else if (strcmp(argv[i], "--opt-stats") == 0) {
+            vm.printOptimizerStats = true;
+        } else if (strcmp(argv[i], "--arena-stats") == 0) {
+            vm.printArenaStats = true;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            showMemoryStats = true;
+        } else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc) {
+            vm.memory.limit = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            samplePath = argv[++i];
+        } else if (strcmp(argv[i], "--sample-interval") == 0 && i + 1 < argc) {
+            sampleInterval = atol(argv[++i]);
+            if (sampleInterval < 1) usage();
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            vm.jit = true;
+        } else if (strcmp(argv[i], "--emit-cpp") == 0 && i + 1 < argc) {
+            emitPath = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchPath = argv[++i];
+        } else if (strcmp(argv[i], "--compile-threads") == 0 && i + 1 < argc) {
+            vm.compileThreads = atoi(argv[++i]);
+            if (vm.compileThreads < 1) usage();
+        } else if (strcmp(argv[i], "--jit-selftest") == 0) {
+            freeVM(&vm);
+            return jitSelfTest(10000, 1) ? 0 : 1;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            freeVM(&vm);
+            return runBenchmark(argv[i + 1]) ? 0 : 64;
+        } else if (strcmp(argv[i], "--aot-selftest") == 0) {
+            freeVM(&vm);
+            // each expression is a compiler run, hence far fewer than the JIT's
+            return aotSelfTest(200, 1) ? 0 : 1;
+        } else if (argv[i][0] != '-' && path == nullptr) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    Profile profile;
+    initProfile(&profile);
+    if (profilePath != nullptr) vm.profile = &profile;
+    Sampler sampler;
+    initSampler(&sampler, sampleInterval);
+    if (samplePath != nullptr) vm.sampler = &sampler;
+
+    if (emitPath != nullptr) {
+        if (path == nullptr) usage();
+        emitFile(&vm, path, emitPath);
+    } else if (batchPath != nullptr) {
+        if (path == nullptr) usage();
+        batchFile(&vm, path, batchPath);
+    } else if (path == nullptr) {
+        repl(&vm);
     } else {
-        fprintf(stderr, "Usage: Ioapp [path]\n");
-        exit(64);
+        runFile(&vm, path);
     }
-    freeVM();
+    freeProfile(&profile);
+    freeSampler(&sampler);
+    freeVM(&vm);
     return 0;
 }
\ No newline at end of file
@@ -1,16 +1,291 @@
 #include <cstdlib>
+#include <cstring>
 #include "memory.hpp"
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+static void *heapReallocate(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize)
 {
+    (void)allocator;
+    (void)oldSize;
     if (newSize == 0)
     {
         free(pointer);
         return nullptr;
     }
 
-    void *result = realloc(pointer, newSize);
+    return realloc(pointer, newSize);
+}
+
+Allocator heapAllocator = {heapReallocate};
+
+static thread_local Allocator *currentAllocator = &heapAllocator;
+static thread_local MemoryAccount *currentAccount = nullptr;
+
+Allocator *useAllocator(Allocator *allocator)
+{
+    Allocator *previous = currentAllocator;
+    currentAllocator = allocator;
+    return previous;
+}
+
+MemoryAccount *useMemoryAccount(MemoryAccount *account)
+{
+    MemoryAccount *previous = currentAccount;
+    currentAccount = account;
+    return previous;
+}
+
+void initMemoryAccount(MemoryAccount *account)
+{
+    memset(account, 0, sizeof(*account));
+}
+
+const char *memoryCategoryName(MemoryCategory category)
+{
+    switch (category)
+    {
+    case MEMORY_CODE:      return "code";
+    case MEMORY_LINES:     return "lines";
+    case MEMORY_CONSTANTS: return "constants";
+    case MEMORY_STACK:     return "stack";
+    case MEMORY_OBJECTS:   return "objects";
+    case MEMORY_COMPILER:  return "compiler";
+    default:               return "other";
+    }
+}
+
+void printMemoryStats(const MemoryAccount *account, FILE *out)
+{
+    fprintf(out, "[memory] %-10s %12s %12s %12s\n", "category", "live", "peak", "allocations");
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+    {
+        fprintf(out, "[memory] %-10s %12zu %12zu %12zu\n", memoryCategoryName((MemoryCategory)i),
+                account->categoryBytes[i], account->categoryPeakBytes[i], account->categoryAllocations[i]);
+    }
+    fprintf(out, "[memory] %-10s %12zu %12zu %12zu\n", "total", account->liveBytes, account->peakBytes,
+            account->allocations);
+    fprintf(out, "[memory] %-10s %12zu %12zu %12zu blocks, in the total instead of what they hold\n",
+            "arenas", account->arenaBytes, account->arenaPeakBytes, account->arenaBlocks);
+    if (account->limit != 0)
+        fprintf(out, "[memory] limit %zu bytes%s\n", account->limit, account->exhausted ? ", exceeded" : "");
+}
+
+// Move a charge of oldSize bytes to newSize bytes, in the total the limit
+// applies to and in one category respectively.
+static void chargeTotal(MemoryAccount *account, size_t oldSize, size_t newSize)
+{
+    account->liveBytes = account->liveBytes - oldSize + newSize;
+    if (account->liveBytes > account->peakBytes)
+        account->peakBytes = account->liveBytes;
+}
+
+static void chargeCategory(MemoryAccount *account, MemoryCategory category, size_t oldSize, size_t newSize)
+{
+    account->categoryBytes[category] = account->categoryBytes[category] - oldSize + newSize;
+    if (account->categoryBytes[category] > account->categoryPeakBytes[category])
+        account->categoryPeakBytes[category] = account->categoryBytes[category];
+}
+
+static bool arenaServes(Allocator *allocator, void *pointer);
+
+void *reallocate(MemoryCategory category, void *pointer, size_t oldSize, size_t newSize)
+{
+    MemoryAccount *account = currentAccount;
+    if (account == nullptr)
+    {
+        void *result = currentAllocator->reallocate(currentAllocator, pointer, oldSize, newSize);
+        if (result == nullptr && newSize != 0)
+            exit(1);
+        return result;
+    }
+
+    // an arena charges the total for the blocks it reserves, in
+    // arenaAllocate(), rather than for what it hands out of them; the
+    // categories still count what was handed out
+    bool arena = arenaServes(currentAllocator, pointer);
+    if (!arena && newSize > oldSize && account->limit != 0 &&
+        account->liveBytes + (newSize - oldSize) > account->limit)
+    {
+        account->exhausted = true;
+        return nullptr;
+    }
+    void *result = currentAllocator->reallocate(currentAllocator, pointer, oldSize, newSize);
+    if (result == nullptr && newSize != 0)
+    {
+        account->exhausted = true;
+        return nullptr;
+    }
+
+    if (!arena)
+        chargeTotal(account, oldSize, newSize);
+    chargeCategory(account, category, oldSize, newSize);
+    if (newSize != 0)
+    {
+        account->allocations++;
+        account->categoryAllocations[category]++;
+    }
+    return result;
+}
+
+#define ARENA_ALIGNMENT 16
+// the first block, each later one twice the last up to ARENA_BLOCK_MAX;
+// a larger request gets a block of exactly its size
+#define ARENA_BLOCK_MIN (4 * 1024)
+#define ARENA_BLOCK_MAX (1024 * 1024)
+
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t size;
+};
+
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static size_t alignSize(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static char *blockData(ArenaBlock *block)
+{
+    return (char *)block + ARENA_HEADER;
+}
+
+static bool arenaOwns(Arena *arena, void *pointer)
+{
+    // the current block, which holds whatever was handed out last, and
+    // anything outside every block are answered without walking the list
+    char *address = (char *)pointer;
+    if (arena->blocks != nullptr && address >= blockData(arena->blocks) && address < arena->limit)
+        return true;
+    if (address < arena->lowest || address >= arena->highest)
+        return false;
+    for (ArenaBlock *block = arena->blocks->next; block != nullptr; block = block->next)
+    {
+        if (address >= blockData(block) && address < blockData(block) + block->size)
+            return true;
+    }
+    return false;
+}
+
+static void *arenaAllocate(Arena *arena, size_t size)
+{
+    size = alignSize(size);
+    if ((size_t)(arena->limit - arena->next) < size)
+    {
+        size_t blockSize = size > arena->blockSize ? size : arena->blockSize;
+        // every block is charged to one account, the one in place when the
+        // first was taken, and freeArena() gives all of it back
+        MemoryAccount *account = arena->account != nullptr ? arena->account : currentAccount;
+        if (account != nullptr && account->limit != 0 &&
+            account->liveBytes + ARENA_HEADER + blockSize > account->limit)
+            return nullptr;
+        ArenaBlock *block = (ArenaBlock *)malloc(ARENA_HEADER + blockSize);
+        if (block == nullptr)
+            return nullptr;
+        if (account != nullptr)
+        {
+            chargeTotal(account, 0, ARENA_HEADER + blockSize);
+            account->arenaBytes += ARENA_HEADER + blockSize;
+            if (account->arenaBytes > account->arenaPeakBytes)
+                account->arenaPeakBytes = account->arenaBytes;
+            account->arenaBlocks++;
+            arena->account = account;
+            arena->chargedBytes += ARENA_HEADER + blockSize;
+        }
+        block->next = arena->blocks;
+        block->size = blockSize;
+        arena->blocks = block;
+        arena->next = blockData(block);
+        arena->limit = arena->next + blockSize;
+        if (arena->lowest == nullptr || arena->next < arena->lowest)
+            arena->lowest = arena->next;
+        if (arena->limit > arena->highest)
+            arena->highest = arena->limit;
+        if (arena->blockSize < ARENA_BLOCK_MAX)
+            arena->blockSize *= 2;
+        arena->stats.blocks++;
+        arena->stats.reservedBytes += blockSize;
+    }
+
+    void *result = arena->next;
+    arena->next += size;
+    arena->last = result;
+    arena->stats.allocations++;
+    arena->stats.bytes += size;
+    return result;
+}
+
+static void *arenaReallocate(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize)
+{
+    Arena *arena = (Arena *)allocator;
+    if (!arenaServes(allocator, pointer))
+        return heapAllocator.reallocate(&heapAllocator, pointer, oldSize, newSize);
+
+    bool isLast = pointer != nullptr && pointer == arena->last;
+    if (newSize == 0)
+    {
+        if (isLast)
+        {
+            arena->next = (char *)pointer;
+            arena->last = nullptr;
+        }
+        return nullptr;
+    }
+
+    if (isLast && (size_t)(arena->limit - (char *)pointer) >= alignSize(newSize))
+    {
+        arena->next = (char *)pointer + alignSize(newSize);
+        arena->stats.allocations++;
+        arena->stats.bytes += alignSize(newSize);
+        return pointer;
+    }
+
+    void *result = arenaAllocate(arena, newSize);
     if (result == nullptr)
-        exit(1);
+        return nullptr;
+    if (pointer != nullptr)
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
     return result;
+}
+
+// Whether allocator is an arena that would handle pointer itself rather
+// than pass it on to the heap.
+static bool arenaServes(Allocator *allocator, void *pointer)
+{
+    if (allocator->reallocate != arenaReallocate)
+        return false;
+    Arena *arena = (Arena *)allocator;
+    return pointer == nullptr || pointer == arena->last || arenaOwns(arena, pointer);
+}
+
+void initArena(Arena *arena)
+{
+    arena->allocator.reallocate = arenaReallocate;
+    arena->blocks = nullptr;
+    arena->next = nullptr;
+    arena->limit = nullptr;
+    arena->last = nullptr;
+    arena->blockSize = ARENA_BLOCK_MIN;
+    arena->lowest = nullptr;
+    arena->highest = nullptr;
+    arena->account = nullptr;
+    arena->chargedBytes = 0;
+    memset(&arena->stats, 0, sizeof(arena->stats));
+}
+
+void freeArena(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != nullptr)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    if (arena->account != nullptr)
+    {
+        chargeTotal(arena->account, arena->chargedBytes, 0);
+        arena->account->arenaBytes -= arena->chargedBytes;
+    }
+    initArena(arena);
 }
\ No newline at end of file
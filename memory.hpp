@@ -2,14 +2,126 @@
 
 #include "common.hpp"
 #include <cstddef>
+#include <cstdio>
+
+// What an allocation is for, as far as memory accounting is concerned.
+enum MemoryCategory
+{
+    MEMORY_CODE,      // bytecode and native code
+    MEMORY_LINES,     // line tables
+    MEMORY_CONSTANTS, // constant pools and their index
+    MEMORY_STACK,     // value stacks
+    MEMORY_OBJECTS,   // heap objects
+    MEMORY_COMPILER,  // scratch space of the scanner and compiler
+    MEMORY_OTHER,
+    MEMORY_CATEGORY_COUNT
+};
+
+#define ALLOCATE(category, type, count) \
+    (type *)reallocate(category, nullptr, 0, sizeof(type) * (count))
+
+#define FREE(category, type, pointer) reallocate(category, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)      \
-    (type *)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(category, type, pointer, oldCount, newCount)      \
+    (type *)reallocate(category, pointer, sizeof(type) * (oldCount), \
                        sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0);
+#define FREE_ARRAY(category, type, pointer, oldCount) \
+    reallocate(category, pointer, sizeof(type) * (oldCount), 0);
+
+// Where reallocate() gets memory from. It has the same contract as
+// reallocate(): a null pointer allocates, a newSize of 0 frees.
+struct Allocator
+{
+    void *(*reallocate)(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize);
+};
+
+// malloc/realloc/free; every thread starts out using it
+extern Allocator heapAllocator;
+
+struct ArenaStats
+{
+    // allocations and resizes handed out, and their bytes in total
+    size_t allocations;
+    size_t bytes;
+    // blocks taken from the heap, and their bytes in total
+    int blocks;
+    size_t reservedBytes;
+};
+
+struct ArenaBlock;
+struct MemoryAccount;
+
+// Bump-pointer allocator. Allocating is a pointer increment within the
+// current block, and freeing does nothing, except that the most recent
+// allocation can still grow, shrink or be given back in place. All of it
+// is released at once by freeArena(). Memory the arena did not hand out
+// is passed on to the heap allocator, so structures allocated before an
+// arena was put in place can still be grown and freed while it is.
+struct Arena
+{
+    // first, so the Allocator* passed to useAllocator() is the Arena*
+    Allocator allocator;
+    ArenaBlock *blocks;
+    char *next;
+    char *limit;
+    void *last;
+    size_t blockSize;
+    // from the lowest block's data to the end of the highest one's, so
+    // that most pointers the arena did not hand out are told apart from
+    // its own without walking the blocks
+    char *lowest;
+    char *highest;
+    // the account the blocks are charged to, and how much, headers included
+    MemoryAccount *account;
+    size_t chargedBytes;
+    ArenaStats stats;
+};
+
+void initArena(Arena *arena);
+void freeArena(Arena *arena);
+
+// Memory charged to one VM. The categories count the sizes reallocate()
+// was asked for, whichever allocator provides them. The total, which the
+// limit applies to, counts what is actually held: for memory an arena
+// hands out, that is the blocks the arena takes from the heap, charged
+// as they are taken and given back only when the arena is freed.
+//
+// Only memory that goes through reallocate() is counted. Left out are
+// the optimizer's and the cache writer's std::vector scratch space,
+// which lives only while a program is being prepared or saved, and
+// profiles and samplers, which are diagnostics rather than part of a VM.
+struct MemoryAccount
+{
+    // live bytes may not go above this; 0 for no limit
+    size_t limit;
+    size_t liveBytes;
+    size_t peakBytes;
+    size_t allocations;
+    size_t categoryBytes[MEMORY_CATEGORY_COUNT];
+    size_t categoryPeakBytes[MEMORY_CATEGORY_COUNT];
+    size_t categoryAllocations[MEMORY_CATEGORY_COUNT];
+    // arena blocks, included in liveBytes and peakBytes
+    size_t arenaBytes;
+    size_t arenaPeakBytes;
+    size_t arenaBlocks;
+    // an allocation failed, for the limit or because the system ran out
+    bool exhausted;
+};
+
+void initMemoryAccount(MemoryAccount *account);
+const char *memoryCategoryName(MemoryCategory category);
+void printMemoryStats(const MemoryAccount *account, FILE *out);
+
+// Makes reallocate() on the calling thread use `allocator` and returns
+// the one it used before, for putting back.
+Allocator *useAllocator(Allocator *allocator);
+// Same for the account reallocate() charges; null charges nothing.
+MemoryAccount *useMemoryAccount(MemoryAccount *account);
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
\ No newline at end of file
+// With an account in place, an allocation that fails returns null (and
+// leaves `pointer` as it was) and marks the account exhausted, so the
+// caller can back out and report it. Without one, it exits the process.
+void *reallocate(MemoryCategory category, void *pointer, size_t oldSize, size_t newSize);
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include <cmath>
+#include <vector>
+#include "optimizer.hpp"
+
+// What the optimizer knows statically about the value an instruction
+// leaves on the stack.
+enum StaticType
+{
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_BOOL,
+};
+
+struct Instruction
+{
+    uint8_t op;
+    bool isLiteral; // pushes `value` and nothing else
+    Value value;
+    StaticType type;
+    int line;
+    uint8_t operand; // for the non-literal instructions that take one
+};
+
+static StaticType typeOf(Value value)
+{
+    if (IS_NUMBER(value))
+        return TYPE_NUMBER;
+    if (IS_BOOL(value))
+        return TYPE_BOOL;
+    return TYPE_UNKNOWN;
+}
+
+static Instruction literal(Value value, int line)
+{
+    return Instruction{OP_CONSTANT, true, value, typeOf(value), line, 0};
+}
+
+static std::vector<Instruction> decode(Chunk *chunk)
+{
+    std::vector<Instruction> code;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t raw = chunk->code[offset];
+        uint8_t op = genericOpcode(raw);
+        int line = getLine(chunk, offset);
+        switch (op)
+        {
+        case OP_CONSTANT:
+            code.push_back(literal(chunk->constants.values[chunk->code[offset + 1]], line));
+            break;
+        case OP_CONSTANT_BIG:
+        {
+            uint32_t idx = ((uint32_t)chunk->code[offset + 1] << 16) |
+                           ((uint32_t)chunk->code[offset + 2] << 8) |
+                           (uint32_t)chunk->code[offset + 3];
+            code.push_back(literal(chunk->constants.values[idx], line));
+            break;
+        }
+        case OP_INT8:
+            code.push_back(literal(NUMBER_VAL((int8_t)chunk->code[offset + 1]), line));
+            break;
+        case OP_INT16:
+        case OP_FIXED16:
+        {
+            int16_t immediate = (int16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            code.push_back(literal(NUMBER_VAL(op == OP_FIXED16 ? immediate / 256.0 : immediate), line));
+            break;
+        }
+        case OP_NULL:
+            code.push_back(literal(NULL_VAL, line));
+            break;
+        case OP_TRUE:
+            code.push_back(literal(BOOL_VAL(true), line));
+            break;
+        case OP_FALSE:
+            code.push_back(literal(BOOL_VAL(false), line));
+            break;
+        default:
+            // keep the compiler's unchecked forms, they survive folding
+            code.push_back(Instruction{raw, false, NULL_VAL, TYPE_UNKNOWN, line,
+                                       opcodeLength(op) > 1 ? chunk->code[offset + 1] : (uint8_t)0});
+            break;
+        }
+        offset += opcodeLength(op);
+    }
+    return code;
+}
+
+// Evaluates a binary opcode on two literals exactly as run() would.
+// Returns false when run() would raise an error (or the opcode is not
+// foldable), in which case the instruction is left for the VM.
+static bool foldBinary(uint8_t op, Value a, Value b, Value *result)
+{
+    switch (op)
+    {
+    case OP_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case OP_NOT_EQUAL:
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op)
+    {
+    case OP_ADD:           *result = NUMBER_VAL(x + y);      return true;
+    case OP_SUBTRACT:      *result = NUMBER_VAL(x - y);      return true;
+    case OP_MULTIPLY:      *result = NUMBER_VAL(x * y);      return true;
+    case OP_DIVIDE:        *result = NUMBER_VAL(x / y);      return true;
+    case OP_MODULO:        *result = NUMBER_VAL(fmod(x, y)); return true;
+    case OP_POWER:         *result = NUMBER_VAL(pow(x, y));  return true;
+    case OP_GREATER:       *result = BOOL_VAL(x > y);        return true;
+    case OP_GREATER_EQUAL: *result = BOOL_VAL(x >= y);       return true;
+    case OP_LESS:          *result = BOOL_VAL(x < y);        return true;
+    case OP_LESS_EQUAL:    *result = BOOL_VAL(x <= y);       return true;
+    default:
+        return false;
+    }
+}
+
+static bool isBinary(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_POWER:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Type of the value a non-literal instruction leaves behind, assuming it
+// did not raise a runtime error.
+static StaticType resultType(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_POWER:
+    case OP_NEGATE:
+        return TYPE_NUMBER;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_NOT:
+        return TYPE_BOOL;
+    default:
+        return TYPE_UNKNOWN;
+    }
+}
+
+// The code is straight-line (there are no jumps yet), so a single pass
+// with the output list doubling as an abstract stack is enough: the last
+// entries of `out` are always the producers of the top stack slots.
+static std::vector<Instruction> fold(const std::vector<Instruction> &code)
+{
+    std::vector<Instruction> out;
+    for (const Instruction &instruction : code)
+    {
+        size_t n = out.size();
+        uint8_t op = genericOpcode(instruction.op);
+
+        if (isBinary(op) && n >= 2 && out[n - 2].isLiteral && out[n - 1].isLiteral)
+        {
+            Value result;
+            if (foldBinary(op, out[n - 2].value, out[n - 1].value, &result))
+            {
+                out.pop_back();
+                out.back() = literal(result, instruction.line);
+                continue;
+            }
+        }
+
+        if (op == OP_NEGATE && n >= 1)
+        {
+            Instruction &top = out[n - 1];
+            if (top.isLiteral && IS_NUMBER(top.value))
+            {
+                top = literal(NUMBER_VAL(-AS_NUMBER(top.value)), instruction.line);
+                continue;
+            }
+            // -(-x) == x once x is known to be a number
+            if (genericOpcode(top.op) == OP_NEGATE && !top.isLiteral && n >= 2 && out[n - 2].type == TYPE_NUMBER)
+            {
+                out.pop_back();
+                continue;
+            }
+        }
+
+        if (op == OP_NOT && n >= 1)
+        {
+            Instruction &top = out[n - 1];
+            if (top.isLiteral)
+            {
+                top = literal(BOOL_VAL(isFalsey(top.value)), instruction.line);
+                continue;
+            }
+            // !!x == x once x is known to be a bool, which covers !!!x == !x
+            if (genericOpcode(top.op) == OP_NOT && !top.isLiteral && n >= 2 && out[n - 2].type == TYPE_BOOL)
+            {
+                out.pop_back();
+                continue;
+            }
+        }
+
+        Instruction copy = instruction;
+        if (!copy.isLiteral)
+            copy.type = resultType(op);
+        out.push_back(copy);
+    }
+    return out;
+}
+
+static void emit(Chunk *chunk, const Instruction &instruction)
+{
+    if (!instruction.isLiteral)
+    {
+        writeChunk(chunk, instruction.op, instruction.line);
+        if (opcodeLength(instruction.op) > 1)
+            writeChunk(chunk, instruction.operand, instruction.line);
+        return;
+    }
+
+    Value value = instruction.value;
+    if (IS_NULL(value))
+        writeChunk(chunk, OP_NULL, instruction.line);
+    else if (IS_BOOL(value))
+        writeChunk(chunk, AS_BOOL(value) ? OP_TRUE : OP_FALSE, instruction.line);
+    else
+        writeConstant(chunk, value, instruction.line);
+}
+
+void optimizeChunk(Chunk *chunk, OptimizerStats *stats)
+{
+    std::vector<Instruction> code = decode(chunk);
+    std::vector<Instruction> optimized = fold(code);
+
+    // Re-emitting into a fresh chunk only adds the constants that are
+    // still referenced, which drops the ones folding made unused.
+    Chunk result;
+    initChunk(&result);
+    for (const Instruction &instruction : optimized)
+        emit(&result, instruction);
+    // folding only ever lowers the depth, but recount it for the new code
+    result.maxStack = computeMaxStack(&result);
+
+    if (stats != nullptr)
+    {
+        stats->instructionsBefore = (int)code.size();
+        stats->instructionsAfter = (int)optimized.size();
+        stats->constantsBefore = chunk->constants.count;
+        stats->constantsAfter = result.constants.count;
+    }
+
+    freeChunk(chunk);
+    *chunk = result;
+}
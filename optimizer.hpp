@@ -0,0 +1,15 @@
+#pragma once
+
+#include "chunk.hpp"
+
+struct OptimizerStats
+{
+    int instructionsBefore;
+    int instructionsAfter;
+    int constantsBefore;
+    int constantsAfter;
+};
+
+// Folds constant expressions, cancels redundant instruction pairs and
+// rebuilds the constant pool with only the constants still referenced.
+void optimizeChunk(Chunk *chunk, OptimizerStats *stats);
@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <cstring>
+#include <signal.h>
+#include <sys/time.h>
+#include <vector>
+#include "profiler.hpp"
+#include "debug.hpp"
+#include "memory.hpp"
+
+// the hottest lines printProfile() lists; the collapsed output has them all
+#define PROFILE_REPORT_LINES 20
+
+void initProfile(Profile *profile)
+{
+    memset(profile->opcodeCounts, 0, sizeof(profile->opcodeCounts));
+    memset(profile->opcodeTicks, 0, sizeof(profile->opcodeTicks));
+    profile->chunk = nullptr;
+    profile->offsetCount = 0;
+    profile->offsetCounts = nullptr;
+    profile->offsetTicks = nullptr;
+    profile->offset = -1;
+    profile->op = 0;
+    profile->start = 0;
+}
+
+void freeProfile(Profile *profile)
+{
+    // the profile is a diagnostic, not part of any VM's memory
+    MemoryAccount *previous = useMemoryAccount(nullptr);
+    FREE_ARRAY(MEMORY_OTHER, uint64_t, profile->offsetCounts, profile->offsetCount);
+    FREE_ARRAY(MEMORY_OTHER, uint64_t, profile->offsetTicks, profile->offsetCount);
+    useMemoryAccount(previous);
+    initProfile(profile);
+}
+
+void profileChunk(Profile *profile, const Chunk *chunk)
+{
+    profile->offset = -1;
+    if (profile->chunk == chunk && profile->offsetCount == chunk->count)
+        return;
+
+    MemoryAccount *previous = useMemoryAccount(nullptr);
+    FREE_ARRAY(MEMORY_OTHER, uint64_t, profile->offsetCounts, profile->offsetCount);
+    FREE_ARRAY(MEMORY_OTHER, uint64_t, profile->offsetTicks, profile->offsetCount);
+    profile->offsetCounts = ALLOCATE(MEMORY_OTHER, uint64_t, chunk->count);
+    profile->offsetTicks = ALLOCATE(MEMORY_OTHER, uint64_t, chunk->count);
+    useMemoryAccount(previous);
+    memset(profile->offsetCounts, 0, sizeof(uint64_t) * chunk->count);
+    memset(profile->offsetTicks, 0, sizeof(uint64_t) * chunk->count);
+    profile->chunk = chunk;
+    profile->offsetCount = chunk->count;
+}
+
+struct ProfileEntry
+{
+    int line;
+    uint8_t op;
+    uint64_t count;
+    uint64_t ticks;
+};
+
+// Per-offset totals summed by line and, if byOpcode, by the opcode at
+// each offset as well, in line order. ticks may be null.
+static std::vector<ProfileEntry> collectEntries(const Chunk *chunk, const uint64_t *counts,
+                                                const uint64_t *ticks, int offsetCount, bool byOpcode)
+{
+    std::vector<ProfileEntry> entries;
+    // offsets only go up, so the line table is walked alongside them
+    // rather than searched once per offset as getLine() would
+    int run = 0;
+    for (int offset = 0; offset < offsetCount; offset++)
+    {
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset)
+            run++;
+        if (counts[offset] == 0)
+            continue;
+        ProfileEntry entry;
+        entry.line = chunk->lineCount > 0 ? chunk->lines[run].line : 0;
+        entry.op = byOpcode ? loadOpcode(chunk->code + offset) : 0;
+        entry.count = counts[offset];
+        entry.ticks = ticks != nullptr ? ticks[offset] : 0;
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const ProfileEntry &a, const ProfileEntry &b) {
+        return a.line != b.line ? a.line < b.line : a.op < b.op;
+    });
+
+    size_t merged = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (merged > 0 && entries[merged - 1].line == entries[i].line && entries[merged - 1].op == entries[i].op)
+        {
+            entries[merged - 1].count += entries[i].count;
+            entries[merged - 1].ticks += entries[i].ticks;
+        }
+        else
+        {
+            entries[merged++] = entries[i];
+        }
+    }
+    entries.resize(merged);
+    return entries;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0.0 : 100.0 * (double)part / (double)total;
+}
+
+void printProfile(const Profile *profile, FILE *out)
+{
+    uint64_t totalCount = 0;
+    uint64_t totalTicks = 0;
+    std::vector<int> opcodes;
+    for (int op = 0; op < 256; op++)
+    {
+        if (profile->opcodeCounts[op] == 0)
+            continue;
+        totalCount += profile->opcodeCounts[op];
+        totalTicks += profile->opcodeTicks[op];
+        opcodes.push_back(op);
+    }
+    std::sort(opcodes.begin(), opcodes.end(), [profile](int a, int b) {
+        return profile->opcodeTicks[a] > profile->opcodeTicks[b];
+    });
+
+    fprintf(out, "[profile] %-28s %14s %16s %7s %10s\n", "opcode", "count", PROFILE_TICK_UNIT, "%", "per op");
+    for (int op : opcodes)
+    {
+        uint64_t count = profile->opcodeCounts[op];
+        uint64_t ticks = profile->opcodeTicks[op];
+        fprintf(out, "[profile] %-28s %14llu %16llu %6.2f%% %10.1f\n", opcodeName((uint8_t)op),
+                (unsigned long long)count, (unsigned long long)ticks, percent(ticks, totalTicks),
+                (double)ticks / (double)count);
+    }
+    fprintf(out, "[profile] %-28s %14llu %16llu\n", "total", (unsigned long long)totalCount,
+            (unsigned long long)totalTicks);
+
+    if (profile->chunk == nullptr)
+        return;
+    std::vector<ProfileEntry> lines = collectEntries(profile->chunk, profile->offsetCounts, profile->offsetTicks,
+                                                     profile->offsetCount, false);
+    std::sort(lines.begin(), lines.end(), [](const ProfileEntry &a, const ProfileEntry &b) {
+        return a.ticks > b.ticks;
+    });
+    fprintf(out, "[profile] %-28s %14s %16s %7s\n", "line", "count", PROFILE_TICK_UNIT, "%");
+    for (size_t i = 0; i < lines.size() && i < PROFILE_REPORT_LINES; i++)
+    {
+        const ProfileEntry &entry = lines[i];
+        fprintf(out, "[profile] %-28d %14llu %16llu %6.2f%%\n", entry.line, (unsigned long long)entry.count,
+                (unsigned long long)entry.ticks, percent(entry.ticks, totalTicks));
+    }
+    if (lines.size() > PROFILE_REPORT_LINES)
+        fprintf(out, "[profile] ... %zu more lines\n", lines.size() - PROFILE_REPORT_LINES);
+}
+
+bool writeCollapsedProfile(const Profile *profile, FILE *out)
+{
+    if (profile->chunk == nullptr)
+        return true;
+    for (const ProfileEntry &entry : collectEntries(profile->chunk, profile->offsetCounts, profile->offsetTicks,
+                                                    profile->offsetCount, true))
+    {
+        if (fprintf(out, "script;line %d;%s %llu\n", entry.line, opcodeName(entry.op),
+                    (unsigned long long)entry.ticks) < 0)
+            return false;
+    }
+    return true;
+}
+
+// the sampler whose timer is armed
+static std::atomic<Sampler *> activeSampler{nullptr};
+static struct sigaction previousAction;
+
+static_assert(std::atomic<const uint8_t *>::is_always_lock_free,
+              "the signal handler reads Sampler::current");
+
+static void onProfilingSignal(int signal, siginfo_t *info, void *context)
+{
+    (void)signal;
+    (void)info;
+    (void)context;
+    // only lock-free atomics from here on, nothing that could take a lock
+    Sampler *sampler = activeSampler.load(std::memory_order_relaxed);
+    if (sampler == nullptr)
+        return;
+    const Chunk *chunk = sampler->running.load(std::memory_order_relaxed);
+    if (chunk == nullptr)
+        return;
+    const uint8_t *ip = sampler->current.load(std::memory_order_relaxed);
+    if (ip == nullptr || ip < chunk->code || ip >= chunk->code + chunk->count)
+    {
+        sampler->unattributed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    size_t head = sampler->head.load(std::memory_order_relaxed);
+    if (head - sampler->tail.load(std::memory_order_acquire) == SAMPLE_RING_CAPACITY)
+    {
+        sampler->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // ip is published before the opcode is read, so it is the start of
+    // the instruction in progress
+    sampler->ring[head % SAMPLE_RING_CAPACITY] = (uint32_t)(ip - chunk->code);
+    sampler->head.store(head + 1, std::memory_order_release);
+}
+
+void initSampler(Sampler *sampler, long intervalMicros)
+{
+    sampler->current.store(nullptr, std::memory_order_relaxed);
+    sampler->running.store(nullptr, std::memory_order_relaxed);
+    sampler->ring = nullptr;
+    sampler->head.store(0, std::memory_order_relaxed);
+    sampler->tail.store(0, std::memory_order_relaxed);
+    sampler->dropped.store(0, std::memory_order_relaxed);
+    sampler->unattributed.store(0, std::memory_order_relaxed);
+    sampler->intervalMicros = intervalMicros;
+    sampler->armed = false;
+    sampler->chunk = nullptr;
+    sampler->offsetCount = 0;
+    sampler->offsetSamples = nullptr;
+}
+
+void freeSampler(Sampler *sampler)
+{
+    if (sampler->armed)
+    {
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &previousAction, nullptr);
+        activeSampler.store(nullptr);
+        sampler->armed = false;
+    }
+    MemoryAccount *previous = useMemoryAccount(nullptr);
+    FREE_ARRAY(MEMORY_OTHER, uint32_t, sampler->ring, SAMPLE_RING_CAPACITY);
+    FREE_ARRAY(MEMORY_OTHER, uint64_t, sampler->offsetSamples, sampler->offsetCount);
+    useMemoryAccount(previous);
+    initSampler(sampler, sampler->intervalMicros);
+}
+
+static bool armSampler(Sampler *sampler)
+{
+    Sampler *expected = nullptr;
+    if (!activeSampler.compare_exchange_strong(expected, sampler))
+        return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onProfilingSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previousAction) != 0)
+    {
+        activeSampler.store(nullptr);
+        return false;
+    }
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = sampler->intervalMicros / 1000000;
+    timer.it_interval.tv_usec = sampler->intervalMicros % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0)
+    {
+        sigaction(SIGPROF, &previousAction, nullptr);
+        activeSampler.store(nullptr);
+        return false;
+    }
+    sampler->armed = true;
+    return true;
+}
+
+bool startSampling(Sampler *sampler, const Chunk *chunk)
+{
+    if (!sampler->armed && !armSampler(sampler))
+        return false;
+
+    MemoryAccount *previous = useMemoryAccount(nullptr);
+    if (sampler->ring == nullptr)
+        sampler->ring = ALLOCATE(MEMORY_OTHER, uint32_t, SAMPLE_RING_CAPACITY);
+    if (sampler->chunk != chunk || sampler->offsetCount != chunk->count)
+    {
+        FREE_ARRAY(MEMORY_OTHER, uint64_t, sampler->offsetSamples, sampler->offsetCount);
+        sampler->offsetSamples = ALLOCATE(MEMORY_OTHER, uint64_t, chunk->count);
+        memset(sampler->offsetSamples, 0, sizeof(uint64_t) * chunk->count);
+        sampler->chunk = chunk;
+        sampler->offsetCount = chunk->count;
+    }
+    useMemoryAccount(previous);
+
+    sampler->current.store(nullptr, std::memory_order_relaxed);
+    sampler->running.store(chunk, std::memory_order_release);
+    return true;
+}
+
+void stopSampling(Sampler *sampler)
+{
+    sampler->running.store(nullptr, std::memory_order_release);
+    sampler->current.store(nullptr, std::memory_order_relaxed);
+
+    size_t head = sampler->head.load(std::memory_order_acquire);
+    size_t tail = sampler->tail.load(std::memory_order_relaxed);
+    for (; tail != head; tail++)
+    {
+        uint32_t offset = sampler->ring[tail % SAMPLE_RING_CAPACITY];
+        if (offset < (uint32_t)sampler->offsetCount)
+            sampler->offsetSamples[offset]++;
+    }
+    sampler->tail.store(tail, std::memory_order_release);
+}
+
+// The samples per offset with those that landed on operand bytes moved
+// to the start of their instruction.
+static std::vector<uint64_t> instructionSamples(const Sampler *sampler)
+{
+    const Chunk *chunk = sampler->chunk;
+    std::vector<uint64_t> samples(sampler->offsetSamples, sampler->offsetSamples + sampler->offsetCount);
+    for (int offset = 0; offset < chunk->count; offset += opcodeLength(loadOpcode(chunk->code + offset)))
+    {
+        for (int i = 1; i < opcodeLength(loadOpcode(chunk->code + offset)) && offset + i < chunk->count; i++)
+        {
+            samples[offset] += samples[offset + i];
+            samples[offset + i] = 0;
+        }
+    }
+    return samples;
+}
+
+void printSamples(const Sampler *sampler, FILE *out)
+{
+    uint64_t dropped = sampler->dropped.load(std::memory_order_relaxed);
+    uint64_t unattributed = sampler->unattributed.load(std::memory_order_relaxed);
+    if (sampler->chunk == nullptr)
+    {
+        fprintf(out, "[sample] no samples\n");
+        return;
+    }
+
+    std::vector<uint64_t> samples = instructionSamples(sampler);
+    uint64_t total = 0;
+    uint64_t opcodeSamples[256] = {};
+    for (int offset = 0; offset < sampler->offsetCount; offset++)
+    {
+        total += samples[offset];
+        opcodeSamples[loadOpcode(sampler->chunk->code + offset)] += samples[offset];
+    }
+    std::vector<int> opcodes;
+    for (int op = 0; op < 256; op++)
+    {
+        if (opcodeSamples[op] != 0)
+            opcodes.push_back(op);
+    }
+    std::sort(opcodes.begin(), opcodes.end(), [&opcodeSamples](int a, int b) {
+        return opcodeSamples[a] > opcodeSamples[b];
+    });
+
+    fprintf(out, "[sample] %llu samples every %ld us, %llu unattributed, %llu dropped\n",
+            (unsigned long long)total, sampler->intervalMicros, (unsigned long long)unattributed,
+            (unsigned long long)dropped);
+    fprintf(out, "[sample] %-28s %14s %7s\n", "opcode", "samples", "%");
+    for (int op : opcodes)
+    {
+        fprintf(out, "[sample] %-28s %14llu %6.2f%%\n", opcodeName((uint8_t)op),
+                (unsigned long long)opcodeSamples[op], percent(opcodeSamples[op], total));
+    }
+
+    std::vector<ProfileEntry> lines = collectEntries(sampler->chunk, samples.data(), nullptr, sampler->offsetCount,
+                                                     false);
+    std::sort(lines.begin(), lines.end(), [](const ProfileEntry &a, const ProfileEntry &b) {
+        return a.count > b.count;
+    });
+    fprintf(out, "[sample] %-28s %14s %7s\n", "line", "samples", "%");
+    for (size_t i = 0; i < lines.size() && i < PROFILE_REPORT_LINES; i++)
+    {
+        fprintf(out, "[sample] %-28d %14llu %6.2f%%\n", lines[i].line, (unsigned long long)lines[i].count,
+                percent(lines[i].count, total));
+    }
+    if (lines.size() > PROFILE_REPORT_LINES)
+        fprintf(out, "[sample] ... %zu more lines\n", lines.size() - PROFILE_REPORT_LINES);
+}
+
+bool writeCollapsedSamples(const Sampler *sampler, FILE *out)
+{
+    if (sampler->chunk == nullptr)
+        return true;
+    std::vector<uint64_t> samples = instructionSamples(sampler);
+    for (const ProfileEntry &entry : collectEntries(sampler->chunk, samples.data(), nullptr, sampler->offsetCount,
+                                                    true))
+    {
+        if (fprintf(out, "script;line %d;%s %llu\n", entry.line, opcodeName(entry.op),
+                    (unsigned long long)entry.count) < 0)
+            return false;
+    }
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include "chunk.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+// Ticks are TSC cycles on x86 and nanoseconds elsewhere; they are only
+// ever compared with each other, never converted to seconds.
+#if defined(__x86_64__) || defined(__i386__)
+    #define PROFILE_TICK_UNIT "cycles"
+#else
+    #define PROFILE_TICK_UNIT "ns"
+#endif
+
+static inline uint64_t readTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Execution counts and ticks gathered by run<RUN_PROFILE>. Each
+// instruction is charged the ticks from its own dispatch to the next one,
+// so the cost of dispatching is included. Per-opcode totals are kept by
+// the opcode that actually ran; per-offset totals are reported under the
+// opcode at that offset when the report is made, which after quickening
+// may be the number-only variant.
+struct Profile
+{
+    // indexed by opcode byte, so unknown opcodes need no range check
+    uint64_t opcodeCounts[256];
+    uint64_t opcodeTicks[256];
+    // the chunk the offset arrays below describe
+    const Chunk *chunk;
+    int offsetCount;
+    uint64_t *offsetCounts;
+    uint64_t *offsetTicks;
+    // the instruction being timed, offset -1 if none
+    int offset;
+    uint8_t op;
+    uint64_t start;
+};
+
+void initProfile(Profile *profile);
+void freeProfile(Profile *profile);
+// Makes room for one counter per byte of chunk, clearing the offset
+// totals if the profile last described another chunk. The counters are
+// not charged to any memory account.
+void profileChunk(Profile *profile, const Chunk *chunk);
+
+// Ends the instruction being timed, if any, at `now`.
+static inline void endProfiledInstruction(Profile *profile, uint64_t now)
+{
+    if (profile->offset < 0)
+        return;
+    uint64_t ticks = now - profile->start;
+    profile->opcodeTicks[profile->op] += ticks;
+    profile->offsetTicks[profile->offset] += ticks;
+    profile->offset = -1;
+}
+
+// Starts timing the instruction at offset, ending the one before it.
+static inline void profileInstruction(Profile *profile, int offset, uint8_t op, uint64_t now)
+{
+    endProfiledInstruction(profile, now);
+    profile->opcodeCounts[op]++;
+    profile->offsetCounts[offset]++;
+    profile->offset = offset;
+    profile->op = op;
+    profile->start = now;
+}
+
+// Opcodes and source lines, each sorted by ticks, most expensive first.
+void printProfile(const Profile *profile, FILE *out);
+// One "script;line N;OPCODE ticks" line per line and opcode, the collapsed
+// stack format that flamegraph.pl and speedscope read.
+bool writeCollapsedProfile(const Profile *profile, FILE *out);
+
+// Statistical profiling: while run<RUN_SAMPLE> runs, a SIGPROF timer
+// interrupts it every intervalMicros of CPU time and the handler pushes
+// the offset of the instruction in progress into a ring buffer. The
+// samples are mapped to opcodes and lines once the run is over, so the
+// opcode reported for an offset is the one there at that point. run()
+// publishes ip at every dispatch for the handler to read, which costs a
+// store per instruction in RUN_SAMPLE only.
+
+#define SAMPLE_RING_CAPACITY 65536
+#define SAMPLE_INTERVAL_MICROS 1000
+
+struct Sampler
+{
+    // the instruction run() is about to execute, where run() publishes it;
+    // lock-free, so the signal handler can read it
+    std::atomic<const uint8_t *> current;
+    // the chunk being sampled, null between runs
+    std::atomic<const Chunk *> running;
+    // single producer (the signal handler), single consumer (stopSampling)
+    uint32_t *ring;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    // samples lost to a full ring, or taken before run() published an
+    // instruction of the chunk
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> unattributed;
+    long intervalMicros;
+    bool armed;
+    // samples by offset, including operand bytes, of the chunk last sampled
+    const Chunk *chunk;
+    int offsetCount;
+    uint64_t *offsetSamples;
+};
+
+#define PUBLISH_SAMPLE_IP(sampler, pointer) (sampler)->current.store((pointer), std::memory_order_relaxed)
+
+void initSampler(Sampler *sampler, long intervalMicros);
+// Disarms the timer if this sampler armed it.
+void freeSampler(Sampler *sampler);
+// Starts taking samples for a run of chunk. The timer is armed on first
+// use and stays armed until freeSampler(), so that repeated short runs
+// are sampled too. Only one sampler can be armed in the process; returns
+// false if another one is, or the timer cannot be set, in which case the
+// run goes unsampled.
+bool startSampling(Sampler *sampler, const Chunk *chunk);
+// Stops taking samples and adds the buffered ones to the totals.
+void stopSampling(Sampler *sampler);
+
+// Opcodes and source lines, each ranked by samples.
+void printSamples(const Sampler *sampler, FILE *out);
+// The same collapsed stack format as writeCollapsedProfile(), weighted by
+// samples.
+bool writeCollapsedSamples(const Sampler *sampler, FILE *out);
\ No newline at end of file
@@ -1,66 +1,352 @@
 #include <cstdio>
 #include <string>
 #include <cstring>
-#include <cctype>
+#include <thread>
+#include <vector>
 #include "scanner.hpp"
 #include "common.hpp"
+#include "memory.hpp"
 
-Scanner scanner;
+#ifdef SCANNER_SSE2
+#include <emmintrin.h>
+#endif
 
-void initScanner(const char* source){
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
-    scanner.tokenQueue.clear();
+void initScanner(Scanner* scanner, const char* source, size_t length){
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + length;
+    scanner->line = 1;
+    scanner->queueHead = 0;
+    scanner->queueCount = 0;
+    scanner->interpolationDepth = 0;
 }
 
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+// Character classes, looked up once per byte instead of going through
+// the locale-dependent <cctype> functions. Bytes outside ASCII are never
+// part of a token.
+enum CharClass : uint8_t {
+    CHAR_INVALID,
+    CHAR_SPACE,    // ' ', '\t', '\r'
+    CHAR_NEWLINE,
+    CHAR_DIGIT,
+    CHAR_ALPHA,    // letters and '_'
+    CHAR_SINGLE,   // always a one-character token, see singleTokens
+    CHAR_OPERATOR, // may combine with the characters after it
+    CHAR_QUOTE,
+};
+
+struct CharTable {
+    CharClass classes[256];
+    TokenType singleTokens[256];
+};
+
+static constexpr CharTable buildCharTable() {
+    CharTable table{};
+    for (int c = 0; c < 256; c++) {
+        table.classes[c] = CHAR_INVALID;
+        table.singleTokens[c] = TOKEN_ERROR;
+    }
+    table.classes[(uint8_t)' '] = CHAR_SPACE;
+    table.classes[(uint8_t)'\t'] = CHAR_SPACE;
+    table.classes[(uint8_t)'\r'] = CHAR_SPACE;
+    table.classes[(uint8_t)'\n'] = CHAR_NEWLINE;
+    for (int c = '0'; c <= '9'; c++) table.classes[c] = CHAR_DIGIT;
+    for (int c = 'a'; c <= 'z'; c++) table.classes[c] = CHAR_ALPHA;
+    for (int c = 'A'; c <= 'Z'; c++) table.classes[c] = CHAR_ALPHA;
+    table.classes[(uint8_t)'_'] = CHAR_ALPHA;
+
+    const struct { char c; TokenType type; } singles[] = {
+        {'(', TOKEN_LEFT_PAREN},   {')', TOKEN_RIGHT_PAREN},
+        {'[', TOKEN_LEFT_BRACKET}, {']', TOKEN_RIGHT_BRACKET},
+        {'{', TOKEN_LEFT_BRACE},   {',', TOKEN_COMMA},
+        {';', TOKEN_SEMICOLON},    {'.', TOKEN_DOT},
+        {'?', TOKEN_QMARK},        {':', TOKEN_COLON},
+        {'$', TOKEN_DOLSIGN},
+    };
+    for (const auto& single : singles) {
+        table.classes[(uint8_t)single.c] = CHAR_SINGLE;
+        table.singleTokens[(uint8_t)single.c] = single.type;
+    }
+    for (char c : {'}', '+', '-', '*', '/', '%', '^', '!', '=', '<', '>'}) {
+        table.classes[(uint8_t)c] = CHAR_OPERATOR;
+    }
+    table.classes[(uint8_t)'"'] = CHAR_QUOTE;
+    table.classes[39] = CHAR_QUOTE;
+    return table;
+}
+
+static constexpr CharTable chars = buildCharTable();
+
+static inline CharClass charClass(char c) {
+    return chars.classes[(uint8_t)c];
 }
 
-static bool isAlpha(char c) {
-    return (isalpha(c) || c=='_');
+static inline bool isDigit(char c) {
+    return charClass(c) == CHAR_DIGIT;
 }
 
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static inline bool isIdentifierChar(char c) {
+    return charClass(c) == CHAR_DIGIT || charClass(c) == CHAR_ALPHA;
 }
 
-static char peek() {
-    return *scanner.current;
+// Keywords live in a perfect hash table: the multiplier is searched for
+// at compile time so that every keyword gets a slot of its own, and
+// recognizing one is a single probe plus a memcmp.
+struct Keyword {
+    const char* name;
+    int length;
+    TokenType type;
+};
+
+static constexpr Keyword keywords[] = {
+    {"and", 3, TOKEN_AND},         {"break", 5, TOKEN_BREAK},
+    {"case", 4, TOKEN_CASE},       {"class", 5, TOKEN_CLASS},
+    {"continue", 8, TOKEN_CONTINUE}, {"else", 4, TOKEN_ELSE},
+    {"false", 5, TOKEN_FALSE},     {"for", 3, TOKEN_FOR},
+    {"func", 4, TOKEN_FUNC},       {"if", 2, TOKEN_IF},
+    {"import", 6, TOKEN_IMPORT},   {"in", 2, TOKEN_IN},
+    {"is", 2, TOKEN_IS},           {"match", 5, TOKEN_MATCH},
+    {"null", 4, TOKEN_NULL},       {"or", 2, TOKEN_OR},
+    {"return", 6, TOKEN_RETURN},   {"self", 4, TOKEN_SELF},
+    {"super", 5, TOKEN_SUPER},     {"true", 4, TOKEN_TRUE},
+    {"var", 3, TOKEN_VAR},         {"while", 5, TOKEN_WHILE},
+};
+
+#define KEYWORD_BITS 6
+#define KEYWORD_SLOTS (1 << KEYWORD_BITS)
+
+static_assert(sizeof(keywords) / sizeof(keywords[0]) <= KEYWORD_SLOTS, "too many keywords for the table");
+
+// first, second and last character plus the length, so it can be
+// computed without looking at the whole identifier
+static constexpr uint32_t keywordKey(const char* start, int length) {
+    return (uint32_t)(uint8_t)start[0] |
+           (uint32_t)(uint8_t)start[length > 1 ? 1 : 0] << 8 |
+           (uint32_t)(uint8_t)start[length - 1] << 16 |
+           (uint32_t)length << 24;
 }
 
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static constexpr int keywordSlot(uint32_t key, uint32_t multiplier) {
+    return (int)((key * multiplier) >> (32 - KEYWORD_BITS));
 }
 
-static void skipWhitespace(){
-    for(;;){
-        char c = peek();
-        switch (c) {
-            case ' ' :
-            case '\r' :
-            case '\t' : 
-                advance(); 
+struct KeywordTable {
+    uint32_t multiplier;
+    Keyword slots[KEYWORD_SLOTS];
+};
+
+static constexpr KeywordTable buildKeywordTable() {
+    KeywordTable table{};
+    for (uint32_t multiplier = 0x9E3779B1u;; multiplier += 2) {
+        uint64_t used = 0;
+        bool collision = false;
+        for (const Keyword& keyword : keywords) {
+            int slot = keywordSlot(keywordKey(keyword.name, keyword.length), multiplier);
+            if (used & (uint64_t)1 << slot) {
+                collision = true;
                 break;
-            case '\n':
-                scanner.line++;
-                advance();
+            }
+            used |= (uint64_t)1 << slot;
+        }
+        if (collision) continue;
+
+        table.multiplier = multiplier;
+        for (Keyword& slot : table.slots) slot = Keyword{"", 0, TOKEN_IDENTIFIER};
+        for (const Keyword& keyword : keywords) {
+            table.slots[keywordSlot(keywordKey(keyword.name, keyword.length), multiplier)] = keyword;
+        }
+        return table;
+    }
+}
+
+static constexpr KeywordTable keywordTable = buildKeywordTable();
+
+static constexpr bool sameName(const char* a, const char* b, int length) {
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// every keyword must find itself, which also proves the hash is perfect
+static constexpr bool keywordTableIsComplete() {
+    for (const Keyword& keyword : keywords) {
+        const Keyword& found = keywordTable.slots[keywordSlot(keywordKey(keyword.name, keyword.length),
+                                                              keywordTable.multiplier)];
+        if (found.type != keyword.type || found.length != keyword.length ||
+            !sameName(found.name, keyword.name, keyword.length)) return false;
+    }
+    return true;
+}
+
+static_assert(keywordTableIsComplete(), "keyword hash table is inconsistent");
+
+static TokenType identifierType(Scanner* scanner) {
+    int length = (int)(scanner->current - scanner->start);
+    const Keyword& candidate = keywordTable.slots[keywordSlot(keywordKey(scanner->start, length),
+                                                              keywordTable.multiplier)];
+    if (candidate.length == length && memcmp(scanner->start, candidate.name, length) == 0) return candidate.type;
+    return TOKEN_IDENTIFIER;
+}
+
+static bool isAtEnd(Scanner* scanner) {
+    return scanner->current >= scanner->end;
+}
+
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
+}
+
+// past the end reads as '\0', which no rule below accepts
+static char peek(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return *scanner->current;
+}
+
+static char peekNext(Scanner* scanner) {
+    if (scanner->current + 1 >= scanner->end) return '\0';
+    return scanner->current[1];
+}
+
+// The skip* helpers below return the first byte in [p, end) that ends a
+// run of some class of characters, or end. The source has no terminator
+// of its own (it may be a file mapped straight into memory), so none of
+// them may read a byte at or past end except as described for scanTo().
+#ifdef SCANNER_SSE2
+
+// Finds the first byte from p on whose bit is set in stopMask(block),
+// adding the newlines skipped before it to *line when line is non-null.
+// Only ever loads aligned 16-byte blocks that start before end: such a
+// block never straddles a page, and its page holds a byte of the source,
+// so it reads no page the source does not already occupy. Bytes of the
+// last block at or past end are ignored.
+template <typename StopMask>
+static const char* scanTo(const char* p, const char* end, StopMask stopMask, int* line) {
+    const char* block = (const char*)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned valid = (0xFFFFu << (p - block)) & 0xFFFFu;
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; block < end; block += 16, valid = 0xFFFF) {
+        __m128i bytes = _mm_load_si128((const __m128i*)block);
+        unsigned stop = (unsigned)stopMask(bytes) & valid;
+        if (end - block < 16) stop |= (0xFFFFu << (end - block)) & valid;
+        unsigned newlines = line != nullptr
+            ? (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) & valid : 0;
+        if (stop != 0) {
+            if (line != nullptr) *line += __builtin_popcount(newlines & ((stop & -stop) - 1));
+            return block + __builtin_ctz(stop);
+        }
+        if (line != nullptr) *line += __builtin_popcount(newlines);
+    }
+    return end;
+}
+
+static inline int byteMask(__m128i bytes, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+
+// bytes in [lo, hi]: c - lo, saturated down by hi - lo, is 0 exactly then
+static inline int rangeMask(__m128i bytes, char lo, char hi) {
+    __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(lo));
+    __m128i over = _mm_subs_epu8(offset, _mm_set1_epi8((char)(hi - lo)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128()));
+}
+
+static const char* skipSpaces(const char* p, const char* end, int* line) {
+    return scanTo(p, end, [](__m128i b) {
+        return ~(byteMask(b, ' ') | byteMask(b, '\t') | byteMask(b, '\r') | byteMask(b, '\n'));
+    }, line);
+}
+
+static const char* skipToLineEnd(const char* p, const char* end) {
+    return scanTo(p, end, [](__m128i b) { return byteMask(b, '\n'); }, nullptr);
+}
+
+static const char* skipToStar(const char* p, const char* end, int* line) {
+    return scanTo(p, end, [](__m128i b) { return byteMask(b, '*'); }, line);
+}
+
+static const char* skipDigits(const char* p, const char* end) {
+    return scanTo(p, end, [](__m128i b) { return ~rangeMask(b, '0', '9'); }, nullptr);
+}
+
+static const char* skipIdentifier(const char* p, const char* end) {
+    return scanTo(p, end, [](__m128i b) {
+        __m128i lower = _mm_or_si128(b, _mm_set1_epi8(0x20));
+        return ~(rangeMask(lower, 'a', 'z') | rangeMask(b, '0', '9') | byteMask(b, '_'));
+    }, nullptr);
+}
+
+// stops at everything string() must look at itself
+static const char* skipStringText(const char* p, const char* end, char quote) {
+    const __m128i quotes = _mm_set1_epi8(quote);
+    return scanTo(p, end, [quotes](__m128i b) {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(b, quotes)) | byteMask(b, '\n') | byteMask(b, '$');
+    }, nullptr);
+}
+
+#else
+
+static const char* skipSpaces(const char* p, const char* end, int* line) {
+    for (; p < end; p++) {
+        if (*p == '\n') (*line)++;
+        else if (*p != ' ' && *p != '\t' && *p != '\r') return p;
+    }
+    return end;
+}
+
+static const char* skipToLineEnd(const char* p, const char* end) {
+    while (p < end && *p != '\n') p++;
+    return p;
+}
+
+static const char* skipToStar(const char* p, const char* end, int* line) {
+    for (; p < end && *p != '*'; p++) {
+        if (*p == '\n') (*line)++;
+    }
+    return p;
+}
+
+static const char* skipDigits(const char* p, const char* end) {
+    while (p < end && isDigit(*p)) p++;
+    return p;
+}
+
+static const char* skipIdentifier(const char* p, const char* end) {
+    while (p < end && isIdentifierChar(*p)) p++;
+    return p;
+}
+
+static const char* skipStringText(const char* p, const char* end, char quote) {
+    while (p < end && *p != quote && *p != '\n' && *p != '$') p++;
+    return p;
+}
+
+#endif
+
+static void skipWhitespace(Scanner* scanner){
+    for(;;){
+        switch (charClass(peek(scanner))) {
+            case CHAR_SPACE:
+            case CHAR_NEWLINE:
+                scanner->current = skipSpaces(scanner->current, scanner->end, &scanner->line);
                 break;
-            case '/':
-                if(peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()) advance();
-                } else if (peekNext() == '*') {
-                    advance(); advance();
-                    while (!isAtEnd()) {
-                        if (peek() == '*' && peekNext() == '/') {
-                            advance(); advance();
+            case CHAR_OPERATOR:
+                if (peek(scanner) != '/') {
+                    return;
+                } else if(peekNext(scanner) == '/') {
+                    scanner->current = skipToLineEnd(scanner->current, scanner->end);
+                } else if (peekNext(scanner) == '*') {
+                    advance(scanner); advance(scanner);
+                    while (!isAtEnd(scanner)) {
+                        scanner->current = skipToStar(scanner->current, scanner->end, &scanner->line);
+                        if (isAtEnd(scanner)) break;
+                        if (peek(scanner) == '*' && peekNext(scanner) == '/') {
+                            advance(scanner); advance(scanner);
                             break;
                         }
-                        if (peek() == '\n') scanner.line++;
-                        advance();
+                        if (peek(scanner) == '\n') scanner->line++;
+                        advance(scanner);
                     }
                 } else {
                     return;
@@ -71,179 +357,251 @@ static void skipWhitespace(){
     }
 }
 
-static bool match(char expected) {
-    if(isAtEnd()) return false;
-    if(*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+    if(isAtEnd(scanner)) return false;
+    if(*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
-static Token makeToken(TokenType type){
+static Token makeToken(Scanner* scanner, TokenType type){
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char* msg){
+static Token errorToken(Scanner* scanner, const char* msg){
     Token token;
     token.type = TOKEN_ERROR;
     token.start = msg;
     token.length = strlen(msg);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static Token dequeueToken() {
-    Token token = scanner.tokenQueue.front();
-    scanner.tokenQueue.erase(scanner.tokenQueue.begin());
+static void enqueueToken(Scanner* scanner, Token token) {
+    int tail = (scanner->queueHead + scanner->queueCount) % TOKEN_QUEUE_CAPACITY;
+    scanner->tokenQueue[tail] = token;
+    scanner->queueCount++;
+}
+
+static Token dequeueToken(Scanner* scanner) {
+    Token token = scanner->tokenQueue[scanner->queueHead];
+    scanner->queueHead = (scanner->queueHead + 1) % TOKEN_QUEUE_CAPACITY;
+    scanner->queueCount--;
     return token;
 }
 
-static Token string(char starting_type) {
-    scanner.start = scanner.current;
+static Token string(Scanner* scanner, char starting_type) {
+    scanner->start = scanner->current;
     
-    while (!isAtEnd()) {
-        if (peek() == starting_type) break;
-        if (peek() == '\n') scanner.line++;
+    while (!isAtEnd(scanner)) {
+        scanner->current = skipStringText(scanner->current, scanner->end, starting_type);
+        if (isAtEnd(scanner)) break;
+        if (peek(scanner) == starting_type) break;
+        if (peek(scanner) == '\n') scanner->line++;
         
-        if (peek() == '$' && peekNext() == '{') {
-            scanner.tokenQueue.push_back(makeToken(TOKEN_STRING));
-            advance(); advance();
-            scanner.interpolationDepth++;
-            scanner.tokenQueue.push_back(makeToken(TOKEN_INTERP_START));
-            return dequeueToken();
+        if (peek(scanner) == '$' && peekNext(scanner) == '{') {
+            enqueueToken(scanner, makeToken(scanner, TOKEN_STRING));
+            advance(scanner); advance(scanner);
+            scanner->interpolationDepth++;
+            enqueueToken(scanner, makeToken(scanner, TOKEN_INTERP_START));
+            return dequeueToken(scanner);
         }
         
-        advance();
+        advance(scanner);
     }
 
-    if(isAtEnd()) return errorToken("Unfinished string.");
+    if(isAtEnd(scanner)) return errorToken(scanner, "Unfinished string.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number() {
-    while(isdigit(peek())) advance();
+static Token number(Scanner* scanner) {
+    scanner->current = skipDigits(scanner->current, scanner->end);
     
-    if(peek() == '.' && isdigit(peekNext())){
-        advance();
-        while(isdigit(peek())) advance();
+    if(peek(scanner) == '.' && isDigit(peekNext(scanner))){
+        advance(scanner);
+        scanner->current = skipDigits(scanner->current, scanner->end);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if(scanner.current - scanner.start == start + length && 
-       memcmp(scanner.start + start, rest, length) == 0) return type;
-
-    return TOKEN_IDENTIFIER;
+static Token identifier(Scanner* scanner) {
+    scanner->current = skipIdentifier(scanner->current, scanner->end);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-        case 'c': 
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
-                    case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-                    case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-                }
-            }
-            break;
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 2, "nc", TOKEN_FUNC);
-                }
-            }
-            break;
-        case 'i':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
-                    case 'n': return checkKeyword(2, 0, "", TOKEN_IN);
-                    case 's': return checkKeyword(2, 0, "", TOKEN_IS);
-                    case 'm': return checkKeyword(2, 4, "port", TOKEN_IMPORT);
-                }
-            }
-            break;
-        case 'm': return checkKeyword(1, 4, "atch", TOKEN_MATCH);
-        case 'n': return checkKeyword(1, 3, "ull", TOKEN_NULL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': 
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'e': return checkKeyword(2, 2, "lf", TOKEN_SELF);
-                    case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
-                }
-            }
-            break;
-        case 't': return checkKeyword(1, 3, "rue", TOKEN_TRUE);
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+Token scanToken(Scanner* scanner){
+    if (scanner->queueCount > 0) return dequeueToken(scanner);
+
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+
+    if(isAtEnd(scanner)) {
+        if(scanner->interpolationDepth > 0) return errorToken(scanner, "Unterminated string interpolation.");
+        return makeToken(scanner, TOKEN_EOF);
     }
-    return TOKEN_IDENTIFIER;
+
+    // True Chad Patters Recognizer
+    char c = advance(scanner);
+    switch (charClass(c)) {
+        case CHAR_DIGIT:    return number(scanner);
+        case CHAR_ALPHA:    return identifier(scanner);
+        case CHAR_SINGLE:   return makeToken(scanner, chars.singleTokens[(uint8_t)c]);
+        case CHAR_QUOTE:    return string(scanner, c);
+        case CHAR_OPERATOR: break;
+        default:            return errorToken(scanner, "Unexpected Character.");
+    }
+
+    switch (c) {
+        case '}': if (scanner->interpolationDepth > 0) {scanner->interpolationDepth--; return makeToken(scanner, TOKEN_INTERP_END);} else return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case '+': return makeToken(scanner, match(scanner, '+') ? TOKEN_PLUS_PLUS : match(scanner, '=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS);
+        case '-': return makeToken(scanner, match(scanner, '-') ? TOKEN_MINUS_MINUS : match(scanner, '=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS);
+        case '*': return makeToken(scanner, match(scanner, '=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
+        case '/': return makeToken(scanner, match(scanner, '=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
+        case '%': return makeToken(scanner, match(scanner, '=') ? TOKEN_PERCENT_EQUAL : TOKEN_PERCENT);
+        case '^': return makeToken(scanner, match(scanner, '=') ? TOKEN_CARET_EQUAL : TOKEN_CARET);
+        case '!': return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        case '=': return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        case '<': return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : match(scanner, '<') ? TOKEN_SHIFT_LEFT : TOKEN_LESS);
+        case '>': return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : match(scanner, '>') ? TOKEN_SHIFT_RIGHT : TOKEN_GREATER);
+    }
+
+
+    return errorToken(scanner, "Unexpected Character.");
+}
+
+void initTokenArray(TokenArray* array) {
+    array->count = 0;
+    array->capacity = 0;
+    array->tokens = nullptr;
 }
 
-static Token identifier() {
-    while(isAlpha(peek()) || isdigit(peek())) advance();
-    return makeToken(identifierType());
+void freeTokenArray(TokenArray* array) {
+    FREE_ARRAY(MEMORY_COMPILER, Token, array->tokens, array->capacity);
+    initTokenArray(array);
 }
 
-Token scanToken(){
-    if (!scanner.tokenQueue.empty()) return dequeueToken();
+static void writeTokens(TokenArray* array, const Token* tokens, int count) {
+    if (count == 0) return;
+    if (array->capacity < array->count + count) {
+        int capacity = array->capacity;
+        while (capacity < array->count + count) capacity = GROW_CAPACITY(capacity);
+        Token* grown = GROW_ARRAY(MEMORY_COMPILER, Token, array->tokens, array->capacity, capacity);
+        // out of memory: the tokens are dropped, see writeChunk()
+        if (grown == nullptr) return;
+        array->tokens = grown;
+        array->capacity = capacity;
+    }
+    memcpy(array->tokens + array->count, tokens, sizeof(Token) * count);
+    array->count += count;
+}
 
-    skipWhitespace();
-    scanner.start = scanner.current;
+// smaller pieces are not worth a thread
+#define SCAN_SEGMENT_MIN (256 * 1024)
 
-    if(isAtEnd()) {
-        if(scanner.interpolationDepth > 0) return errorToken("Unterminated string interpolation.");
-        return makeToken(TOKEN_EOF);
+// Scans until the next token would start at or after `limit` (never, if
+// limit is null) or the source runs out. Returns true in the second case.
+static bool scanUntil(Scanner* scanner, const char* limit, TokenArray* array) {
+    for (;;) {
+        if (scanner->queueCount == 0) {
+            skipWhitespace(scanner);
+            if (limit != nullptr && scanner->current >= limit) return false;
+        }
+        // at the end scanToken() returns the same token forever
+        bool last = scanner->queueCount == 0 && isAtEnd(scanner);
+        Token token = scanToken(scanner);
+        writeTokens(array, &token, 1);
+        if (last) return true;
     }
+}
 
-    // True Chad Patters Recognizer
-    char c = advance();
-    if (isdigit(c)) return number();
-    if (isAlpha(c)) return identifier();
+// One piece of the source. Its scanner starts right after a newline as
+// if nothing came before it and counts lines from 1; whether that guess
+// was right is only known once the piece before it is done.
+struct ScanSegment {
+    const char* begin;
+    const char* limit;
+    TokenArray tokens;
+    // where the first token starts, and its line
+    const char* entry;
+    int entryLine;
+    // state after the last token
+    Scanner exit;
+    bool finished;
+};
 
-    switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': if (scanner.interpolationDepth > 0) {scanner.interpolationDepth--; return makeToken(TOKEN_INTERP_END);} else return makeToken(TOKEN_RIGHT_BRACE);
-        case '[': return makeToken(TOKEN_LEFT_BRACKET);
-        case ']': return makeToken(TOKEN_RIGHT_BRACKET);
-        case ',': return makeToken(TOKEN_COMMA);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case '.': return makeToken(TOKEN_DOT);
-        case '+': return makeToken(match('+') ? TOKEN_PLUS_PLUS : match('=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS);
-        case '-': return makeToken(match('-') ? TOKEN_MINUS_MINUS : match('=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS);
-        case '*': return makeToken(match('=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
-        case '/': return makeToken(match('=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
-        case '%': return makeToken(match('=') ? TOKEN_PERCENT_EQUAL : TOKEN_PERCENT);
-        case '^': return makeToken(match('=') ? TOKEN_CARET_EQUAL : TOKEN_CARET);
-        case '?': return makeToken(TOKEN_QMARK);
-        case ':': return makeToken(TOKEN_COLON);
-        case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-        case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : match('<') ? TOKEN_SHIFT_LEFT : TOKEN_LESS);
-        case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : match('>') ? TOKEN_SHIFT_RIGHT : TOKEN_GREATER);
-        case '"': return string('"');
-        case 39 : return string(39); // <- for ' because ASCII(') = 39
-        case '$': return makeToken(TOKEN_DOLSIGN);
-    }
-
-
-    return errorToken("Unexpected Character.");
+static void scanSegment(ScanSegment* segment) {
+    skipWhitespace(&segment->exit);
+    segment->entry = segment->exit.current;
+    segment->entryLine = segment->exit.line;
+    segment->finished = scanUntil(&segment->exit, segment->limit, &segment->tokens);
+}
+
+void scanAll(const char* source, size_t length, int threads, TokenArray* array) {
+    size_t segmentCount = length / SCAN_SEGMENT_MIN;
+    if (segmentCount > (size_t)threads) segmentCount = threads;
+    if (segmentCount < 1) segmentCount = 1;
+
+    // split after the first newline past each even share of the source
+    ScanSegment* segments = ALLOCATE(MEMORY_COMPILER, ScanSegment, segmentCount);
+    if (segments == nullptr) return;
+    const char* begin = source;
+    size_t count = 0;
+    for (size_t i = 1; i < segmentCount; i++) {
+        const char* split = source + length / segmentCount * i;
+        if (split < begin) continue;
+        const char* newline = (const char*)memchr(split, '\n', source + length - split);
+        if (newline == nullptr) break;
+        segments[count].begin = begin;
+        segments[count].limit = newline + 1;
+        count++;
+        begin = newline + 1;
+    }
+    segments[count].begin = begin;
+    segments[count].limit = nullptr;
+    count++;
+
+    std::vector<std::thread> workers(count);
+    for (size_t i = 1; i < count; i++) {
+        initTokenArray(&segments[i].tokens);
+        initScanner(&segments[i].exit, segments[i].begin, source + length - segments[i].begin);
+        workers[i] = std::thread(scanSegment, &segments[i]);
+    }
+    // the first piece starts where the source does, so it is always right
+    initScanner(&segments[0].exit, source, length);
+    bool finished = scanUntil(&segments[0].exit, segments[0].limit, array);
+    Scanner scanner = segments[0].exit;
+    for (size_t i = 1; i < count; i++) {
+        workers[i].join();
+        ScanSegment* segment = &segments[i];
+        // Same position with nothing pending means the scanner would have
+        // gone on exactly as the piece did; anything else (the newline was
+        // inside a string or a comment) is scanned again from where the
+        // last piece really ended.
+        if (finished) {
+            // a string or comment ran to the end of the source
+        } else if (scanner.current == segment->entry && scanner.queueCount == 0 && scanner.interpolationDepth == 0) {
+            int lineOffset = scanner.line - segment->entryLine;
+            int first = array->count;
+            writeTokens(array, segment->tokens.tokens, segment->tokens.count);
+            for (int j = first; j < array->count; j++) array->tokens[j].line += lineOffset;
+            scanner = segment->exit;
+            scanner.line += lineOffset;
+            finished = segment->finished;
+        } else {
+            finished = scanUntil(&scanner, segment->limit, array);
+        }
+        // allocated on a worker thread, which charges no memory account
+        MemoryAccount* account = useMemoryAccount(nullptr);
+        freeTokenArray(&segment->tokens);
+        useMemoryAccount(account);
+    }
+    FREE_ARRAY(MEMORY_COMPILER, ScanSegment, segments, segmentCount);
 }
\ No newline at end of file
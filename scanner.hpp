@@ -1,7 +1,7 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
-#include <vector>
 
 enum TokenType {
     // Single-character tokens.
@@ -45,14 +45,38 @@ struct Token {
     int line;
 };
 
+// Tokens scanned ahead of time wait in a small ring buffer. Reaching a
+// "${" in a string queues at most two (the text so far and the
+// TOKEN_INTERP_START) and hands the first one out right away, so the
+// queue never holds more than one token between calls.
+#define TOKEN_QUEUE_CAPACITY 4
+
 struct Scanner {
     const char* start;
     const char* current;
+    // one past the last byte of the source, which needs no terminator
+    const char* end;
     int line;
     // for string interpolation
-    std::vector<Token> tokenQueue;
+    Token tokenQueue[TOKEN_QUEUE_CAPACITY];
+    int queueHead;
+    int queueCount;
     int interpolationDepth;
 };
 
-void initScanner(const char* source);
-Token scanToken();
\ No newline at end of file
+// Every token of a source, in the order scanToken() returns them, ending
+// with the TOKEN_EOF (or the error scanToken() would keep repeating).
+struct TokenArray {
+    int count;
+    int capacity;
+    Token* tokens;
+};
+
+void initScanner(Scanner* scanner, const char* source, size_t length);
+Token scanToken(Scanner* scanner);
+void initTokenArray(TokenArray* array);
+void freeTokenArray(TokenArray* array);
+// Scans all of `source` into `array`, splitting it into up to `threads`
+// pieces scanned at the same time. The result is the same token for token
+// as calling scanToken() in a loop.
+void scanAll(const char* source, size_t length, int threads, TokenArray* array);
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include "selftest.hpp"
+
+unsigned nextRandom(unsigned *state)
+{
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void randomNumber(std::string *out, unsigned *state)
+{
+    char buffer[32];
+    switch (nextRandom(state) % 4)
+    {
+    case 0:
+        snprintf(buffer, sizeof(buffer), "%u", nextRandom(state) % 10);
+        break;
+    case 1:
+        snprintf(buffer, sizeof(buffer), "%u", nextRandom(state) % 100000);
+        break;
+    case 2:
+        snprintf(buffer, sizeof(buffer), "%u.%u", nextRandom(state) % 100, nextRandom(state) % 1000);
+        break;
+    default:
+        snprintf(buffer, sizeof(buffer), "0.%03u", nextRandom(state) % 1000);
+        break;
+    }
+    *out += buffer;
+}
+
+void randomExpression(std::string *out, unsigned *state, int depth)
+{
+    static const char *const binaryOps[] = {
+        "+", "-", "*", "/", "%", "^", "==", "!=", "<", "<=", ">", ">=",
+    };
+    static const char *const literals[] = {"true", "false", "null"};
+
+    unsigned roll = nextRandom(state) % (depth <= 0 ? 2 : 10);
+    if (roll == 0)
+    {
+        if (nextRandom(state) % 8 == 0)
+            *out += literals[nextRandom(state) % 3];
+        else
+            randomNumber(out, state);
+    }
+    else if (roll == 1)
+    {
+        randomNumber(out, state);
+    }
+    else if (roll == 2)
+    {
+        // the space keeps "- -1" from scanning as "--"
+        *out += nextRandom(state) % 4 == 0 ? "! " : "- ";
+        randomExpression(out, state, depth - 1);
+    }
+    else if (roll == 3)
+    {
+        *out += "(";
+        randomExpression(out, state, depth - 1);
+        *out += ")";
+    }
+    else
+    {
+        randomExpression(out, state, depth - 1);
+        *out += " ";
+        *out += binaryOps[nextRandom(state) % (sizeof(binaryOps) / sizeof(binaryOps[0]))];
+        *out += " ";
+        randomExpression(out, state, depth - 1);
+    }
+}
+
+int silenceStderr()
+{
+    return captureStderr("/dev/null");
+}
+
+int captureStderr(const char *path)
+{
+    fflush(stderr);
+    int saved = dup(2);
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (file >= 0)
+    {
+        dup2(file, 2);
+        close(file);
+    }
+    return saved;
+}
+
+void restoreStderr(int saved)
+{
+    fflush(stderr);
+    if (saved >= 0)
+    {
+        dup2(saved, 2);
+        close(saved);
+    }
+}
+
+std::string readWholeFile(const char *path)
+{
+    std::string contents;
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+        return contents;
+    char buffer[256];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.append(buffer, length);
+    fclose(file);
+    return contents;
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+// Random programs for the self-tests that check a backend against the
+// interpreter (jitSelfTest(), aotSelfTest()).
+
+// xorshift32, so a failing seed reproduces on every machine
+unsigned nextRandom(unsigned *state);
+// Mostly numeric, with the occasional bool or null so that the operand
+// checks and runtime errors get exercised too.
+void randomExpression(std::string *out, unsigned *state, int depth);
+
+// Runtime errors are expected, so the self-tests keep their reports out
+// of the output: silenceStderr() points stderr at /dev/null, and
+// captureStderr() at a file for them to compare, and both return what
+// restoreStderr() needs to put it back.
+int silenceStderr();
+int captureStderr(const char *path);
+void restoreStderr(int saved);
+// The whole of the file at path, or an empty string if it cannot be read.
+std::string readWholeFile(const char *path);
\ No newline at end of file
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Regression checks for the command-line interpreter:
+#   tests/regress.sh path/to/Ioapp
+# Each check runs the binary on a generated script or data file and
+# compares everything it prints with what is expected.
+set -u
+IFF=${1:?usage: tests/regress.sh path/to/Ioapp}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failures=0
+
+# expect NAME EXPECTED COMMAND...
+expect() {
+    name=$1
+    expected=$2
+    shift 2
+    actual=$("$@" 2>&1)
+    if [ "$actual" = "$expected" ]; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        echo "  expected: $expected"
+        echo "  actual:   $actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# Mapped scripts are not NUL-terminated, so a literal at the very end of
+# a file that fills a whole page must not be read past.
+{ printf '1 +'; head -c 4089 /dev/zero | tr '\0' ' '; printf '1234'; } > "$TMP/page.iff"
+expect "number literal ending a page-sized script" 1235 "$IFF" --no-cache "$TMP/page.iff"
+
+# A NaN read from data keeps no payload that NaN boxing could take for a
+# tag.
+printf 'nan(0x4000000000003)\n2\n' > "$TMP/nan.csv"
+echo '$0' > "$TMP/column.iff"
+echo '1 + 2 * $0' > "$TMP/arithmetic.iff"
+expect "NaN-payload cell read as is" "$(printf 'nan\n2')" "$IFF" --batch "$TMP/nan.csv" "$TMP/column.iff"
+expect "NaN-payload cell in arithmetic" "$(printf 'nan\n5')" "$IFF" --batch "$TMP/nan.csv" "$TMP/arithmetic.iff"
+
+# The cache is only used with --cache, and a cached program is not used
+# for what has to see the compiler run or asks for other code.
+echo '1 + 2 * 3' > "$TMP/cached.iff"
+expect "no cache file without --cache" "$(printf '7\nabsent')" \
+    sh -c '"$1" "$2" && { [ -e "$2.iffc" ] && echo present || echo absent; }' - "$IFF" "$TMP/cached.iff"
+expect "cache file with --cache" "$(printf '7\npresent')" \
+    sh -c '"$1" --cache "$2" && { [ -e "$2.iffc" ] && echo present || echo absent; }' - "$IFF" "$TMP/cached.iff"
+expect "--print-code with a warm cache" 2 \
+    sh -c '"$1" --cache --print-code "$2" 2>&1 | grep -c "^== "' - "$IFF" "$TMP/cached.iff"
+expect "--opt-stats with a warm cache" 1 \
+    sh -c '"$1" --cache --opt-stats "$2" 2>&1 | grep -c "^\[optimizer\]"' - "$IFF" "$TMP/cached.iff"
+expect "--arena-stats with a warm cache" 1 \
+    sh -c '"$1" --cache --arena-stats "$2" 2>&1 | grep -c "^\[arena\]"' - "$IFF" "$TMP/cached.iff"
+expect "--no-optimize with a warm optimized cache" 1 \
+    sh -c '"$1" --cache --no-optimize --trace "$2" 2>&1 | grep -c OP_MULTIPLY' - "$IFF" "$TMP/cached.iff"
+
+[ "$failures" -eq 0 ]
\ No newline at end of file
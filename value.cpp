@@ -9,32 +9,41 @@ void initValueArray(ValueArray *array)
     array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value)
+bool writeValueArray(ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
-        int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        int capacity = GROW_CAPACITY(array->capacity);
+        Value *values = GROW_ARRAY(MEMORY_CONSTANTS, Value, array->values, array->capacity, capacity);
+        if (values == nullptr)
+            return false;
+        array->values = values;
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
     array->count++;
+    return true;
 }
 
 void freeValueArray(ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(MEMORY_CONSTANTS, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
+int formatValue(char *buffer, size_t size, Value value)
+{
+    if (IS_BOOL(value))
+        return snprintf(buffer, size, "%s", AS_BOOL(value) ? "true" : "false");
+    if (IS_NULL(value))
+        return snprintf(buffer, size, "null");
+    return snprintf(buffer, size, "%g", AS_NUMBER(value));
+}
+
 void printValue(Value value)
 {
-    switch (value.type) {
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NULL: printf("null"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-    }
+    char buffer[64];
+    formatValue(buffer, sizeof(buffer), value);
+    fputs(buffer, stdout);
 }
\ No newline at end of file
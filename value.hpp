@@ -1,6 +1,56 @@
 #pragma once
 
 #include "common.hpp"
+#include <cmath>
+#include <cstring>
+
+#ifdef NAN_BOXING
+
+// Every Value is a single 64-bit word. Numbers are stored as their raw
+// double bits; everything else lives inside the quiet-NaN space, which
+// real arithmetic never produces (hardware NaNs only set bit 51):
+//
+//   number   any double whose QNAN bits are not all set
+//   null     QNAN | 01
+//   false    QNAN | 10
+//   true     QNAN | 11
+//   object   SIGN_BIT | QNAN | 48-bit pointer (reserved, no objects yet)
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NULL  1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NULL(value)    ((value) == NULL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NULL_VAL          ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define NUMBER_VAL(num)   numToValue(num)
+
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 enum ValueType {
     VAL_BOOL,
@@ -25,7 +75,37 @@ struct Value {
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NULL_VAL          ((Value){VAL_NULL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = (double)(value)}})
+
+#endif
+
+// Doubles from outside the interpreter (data files, the cache) can be
+// NaNs with any payload, which NaN boxing would read as a tag, so they go
+// through this before NUMBER_VAL: every NaN becomes the plain one that
+// arithmetic produces.
+static inline double canonicalNumber(double num) {
+    return std::isnan(num) ? (double)NAN : num;
+}
+
+static inline bool isFalsey(Value value) {
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static inline bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // numbers compare as doubles so that NaN != NaN and 0 == -0
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    return a == b;
+#else
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NULL:   return true;
+        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return false;
+#endif
+}
 
 struct ValueArray
 {
@@ -36,5 +116,7 @@ struct ValueArray
 
 void initValueArray(ValueArray *array);
 void freeValueArray(ValueArray *array);
-void writeValueArray(ValueArray *array, Value value);
-void printValue(Value value);
\ No newline at end of file
+// false if out of memory, leaving the array as it was
+bool writeValueArray(ValueArray *array, Value value);
+void printValue(Value value);
+int formatValue(char *buffer, size_t size, Value value);
\ No newline at end of file
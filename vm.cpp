@@ -1,159 +1,509 @@
+#include <cassert>
 #include <cstdio>
 #include <cmath>
 #include <string>
 #include <cstdarg>
+#include <cstring>
 #include "vm.hpp"
 #include "debug.hpp"
 #include "common.hpp"
 #include "compiler.hpp"
+#include "optimizer.hpp"
+#include "memory.hpp"
 
-VM vm;
-
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instrucion = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instrucion];
+    size_t instrucion = vm->ip - vm->chunk->code - 1;
+    int line = getLine(vm->chunk, (int)instrucion);
     fprintf(stderr, "[line %d] in script\n", line);
 
-    resetStack();
+    resetStack(vm);
 }
 
-void push(Value value){
-    if (vm.stackTop >= vm.stack + STACK_MAX) {
-        printf("Stack overflow!\n");
-        exit(1);
-    }
-    *vm.stackTop++ = value;
+void push(VM* vm, Value value){
+    assert(vm->stackTop < vm->stack + vm->stackCapacity);
+    *vm->stackTop++ = value;
 }
 
-Value pop(){
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM* vm){
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+void initVM(VM* vm){
+    vm->stack = nullptr;
+    vm->stackCapacity = 0;
+    vm->columns = nullptr;
+    vm->columnCount = 0;
+    resetStack(vm);
+    vm->optimize = true;
+    vm->printOptimizerStats = false;
+    vm->printArenaStats = false;
+    vm->traceExecution = false;
+    vm->printCode = false;
+    vm->jit = false;
+    vm->compileThreads = 1;
+    vm->profile = nullptr;
+    vm->sampler = nullptr;
+    initMemoryAccount(&vm->memory);
 }
 
-void initVM(){
-    resetStack();
+void freeVM(VM* vm){
+    MemoryAccount* previous = useMemoryAccount(&vm->memory);
+    FREE_ARRAY(MEMORY_STACK, Value, vm->stack, vm->stackCapacity);
+    useMemoryAccount(previous);
+    vm->stack = nullptr;
+    vm->stackCapacity = 0;
+    resetStack(vm);
 }
 
-void freeVM(){
+static void reportOutOfMemory(VM* vm) {
+    if (vm->memory.limit != 0) {
+        fprintf(stderr, "Out of memory: the limit is %zu bytes.\n", vm->memory.limit);
+    } else {
+        fprintf(stderr, "Out of memory.\n");
+    }
+}
 
+// Makes room for the chunk's whole stack up front, which is what lets
+// PUSH() in run() skip the overflow check.
+static bool reserveStack(VM* vm, const Chunk* chunk) {
+    if (chunk->maxStack < 0 || chunk->maxStack > STACK_MAX) {
+        fprintf(stderr, "Stack overflow: expression needs %d slots, the limit is %d.\n",
+                chunk->maxStack, STACK_MAX);
+        return false;
+    }
+    if (chunk->maxStack > vm->stackCapacity) {
+        MemoryAccount* previous = useMemoryAccount(&vm->memory);
+        FREE_ARRAY(MEMORY_STACK, Value, vm->stack, vm->stackCapacity);
+        vm->stackCapacity = 0;
+        vm->stack = ALLOCATE(MEMORY_STACK, Value, chunk->maxStack);
+        useMemoryAccount(previous);
+        if (vm->stack == nullptr) {
+            reportOutOfMemory(vm);
+            return false;
+        }
+        vm->stackCapacity = chunk->maxStack;
+    }
+    return true;
 }
 
-static InterpretResult run() { // to be made faster after finishing
-    #define READ_BYTE() (*vm.ip++)
-    #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-    
+// run() is instantiated once per mode, so the instrumentation of one mode
+// costs nothing, not even a branch, in the others.
+enum RunMode {
+    RUN_PLAIN,
+    RUN_TRACE,
+    RUN_PROFILE,
+    RUN_SAMPLE,
+};
+
+template <RunMode MODE>
+static InterpretResult run(VM* vm, Value* result, TraceSink* sink, Profile* profile, Sampler* sampler) {
+    // ip and stackTop live in locals for the whole loop so they can stay in
+    // registers; they are written back to vm only where something else
+    // (runtimeError, the caller) needs to see them.
+    uint8_t* ip = vm->ip;
+    Value* stackTop = vm->stackTop;
+
+    #define READ_BYTE() (*ip++)
+    #define READ_OPCODE() loadOpcode(ip++)
+    #define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+    #define READ_INT16() (ip += 2, (int16_t)((ip[-2] << 8) | ip[-1]))
+    #define PEEK(distance) (stackTop[-1 - (distance)])
+    #define POP() (*--stackTop)
+    // execute() reserved chunk->maxStack slots, so this cannot overflow
+    #define PUSH(value) (*stackTop++ = (value))
+    #define RUNTIME_ERROR(...) do{ \
+        vm->ip = ip; \
+        if constexpr (MODE == RUN_TRACE) flushTraceSink(sink); \
+        if constexpr (MODE == RUN_PROFILE) endProfiledInstruction(profile, readTicks()); \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while(false)
+
     #define BINARY_OP(valueType, op) do{ \
-        if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-           runtimeError("Operands must be numbers."); \
-           return INTERPRET_RUNTIME_ERROR; \ 
+        if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+           RUNTIME_ERROR("Operands must be numbers."); \
         } \
-        double b = AS_NUMBER(pop()); \
-        *(vm.stackTop - 1) = valueType(AS_NUMBER(*(vm.stackTop - 1)) op b); \
+        double b = AS_NUMBER(POP()); \
+        *(stackTop - 1) = valueType(AS_NUMBER(*(stackTop - 1)) op b); \
     } while(false)
 
-    #define POWER_RAISE(valueType) do{ \
-        if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-           runtimeError("Operands must be numbers."); \
-           return INTERPRET_RUNTIME_ERROR; \ 
+    #define BINARY_FN(valueType, fn) do{ \
+        if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+           RUNTIME_ERROR("Operands must be numbers."); \
         } \
-        double b = AS_NUMBER(pop()); \
-        *(vm.stackTop - 1) = valueType(pow(AS_NUMBER(*(vm.stackTop - 1)), b)); \
+        double b = AS_NUMBER(POP()); \
+        *(stackTop - 1) = valueType(fn(AS_NUMBER(*(stackTop - 1)), b)); \
+    } while(false)
+
+    // the compiler only emits these when both operands are proven numbers
+    #define UNCHECKED_OP(valueType, op) do{ \
+        double b = AS_NUMBER(POP()); \
+        *(stackTop - 1) = valueType(AS_NUMBER(*(stackTop - 1)) op b); \
     } while(false)
+    #define UNCHECKED_FN(valueType, fn) do{ \
+        double b = AS_NUMBER(POP()); \
+        *(stackTop - 1) = valueType(fn(AS_NUMBER(*(stackTop - 1)), b)); \
+    } while(false)
+
     //no define for big constants because of irregularities in compiling
 
-    for(;;){
-        #ifdef DEBUG_TRACE_EXECUTION
-            printf("             ");
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
-            }
-            printf("\n");
-            disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-        #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()){
-            case OP_CONSTANT:     {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_CONSTANT_BIG: {
-                uint32_t idx  = (uint32_t)READ_BYTE() << 16;
-                         idx |= (uint32_t)READ_BYTE() << 8;
-                         idx |= (uint32_t)READ_BYTE();
-                Value constant = vm.chunk->constants.values[idx];
-                push(constant);
-                break;
-            }
-            case OP_ADD:          {BINARY_OP(NUMBER_VAL, +);  break;}
-            case OP_SUBTRACT:     {BINARY_OP(NUMBER_VAL, -);  break;}
-            case OP_MULTIPLY:     {BINARY_OP(NUMBER_VAL, *);  break;}
-            case OP_DIVIDE:       {BINARY_OP(NUMBER_VAL, /);  break;}
-            case OP_POWER:        {POWER_RAISE(NUMBER_VAL);   break;}
-            case OP_NEGATE:       {
-                if(!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            }
-            case OP_RETURN:       {
-                printValue(pop());
-                printf("\n");
-                return INTERPRET_OK;
-            }
-            case OP_TRUE:         {
-                push(BOOL_VAL(true));
-                break;
-            }
-            case OP_FALSE:        {
-                push(BOOL_VAL(false));
-                break;
+    // The generic handler rewrites its own opcode into the number-only
+    // variant once it sees two numbers. The variant keeps a guard and, if
+    // it ever sees something else, rewrites itself back and does the
+    // generic opcode's work in place; dispatching again would trace and
+    // profile the instruction twice. Both forms compute the same thing, so
+    // a Program shared between threads stays correct whichever opcode a
+    // thread happens to read, as long as the byte itself is stored and
+    // loaded atomically (storeOpcode(), loadOpcode()).
+    #define QUICKEN(op) storeOpcode(ip - 1, (op))
+    #define QUICKENING_OP(quickened, valueType, op) do{ \
+        if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(quickened); \
+        BINARY_OP(valueType, op); \
+    } while(false)
+    #define QUICKENED_OP(generic, valueType, op) do{ \
+        if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            QUICKEN(generic); \
+            BINARY_OP(valueType, op); \
+            break; \
+        } \
+        double b = AS_NUMBER(POP()); \
+        *(stackTop - 1) = valueType(AS_NUMBER(*(stackTop - 1)) op b); \
+    } while(false)
+
+    #define INSTRUMENT_INSTRUCTION() do{ \
+        if constexpr (MODE == RUN_TRACE) { \
+            traceWrite(sink, "             "); \
+            for (Value* slot = vm->stack; slot < stackTop; slot++) { \
+                traceWrite(sink, "[ "); \
+                traceValue(sink, *slot); \
+                traceWrite(sink, " ]"); \
+            } \
+            traceWrite(sink, "\n"); \
+            disassembleInstruction(sink, vm->chunk, (int)(ip - vm->chunk->code)); \
+        } \
+        if constexpr (MODE == RUN_PROFILE) { \
+            profileInstruction(profile, (int)(ip - vm->chunk->code), loadOpcode(ip), readTicks()); \
+        } \
+        if constexpr (MODE == RUN_SAMPLE) { \
+            PUBLISH_SAMPLE_IP(sampler, ip); \
+        } \
+    } while(false)
+
+    // Every handler ends in its own DISPATCH() so that, with computed gotos,
+    // each opcode gets a separate indirect jump (and branch history) instead
+    // of all of them sharing the single jump at the top of a switch.
+    #ifdef THREADED_DISPATCH
+        // must list a label for every OpCode, in enum order
+        static void* dispatchTable[] = {
+            &&op_RETURN,
+            &&op_CONSTANT, &&op_CONSTANT_BIG,
+            &&op_INT8, &&op_INT16, &&op_FIXED16,
+            &&op_NULL, &&op_TRUE, &&op_FALSE,
+            &&op_COLUMN,
+            &&op_NEGATE, &&op_ADD, &&op_SUBTRACT, &&op_MULTIPLY, &&op_DIVIDE,
+            &&op_MODULO, &&op_POWER,
+            &&op_UNKNOWN /* OP_SHIFT_LEFT */, &&op_UNKNOWN /* OP_SHIFT_RIGHT */,
+            &&op_EQUAL, &&op_NOT_EQUAL,
+            &&op_GREATER, &&op_GREATER_EQUAL, &&op_LESS, &&op_LESS_EQUAL,
+            &&op_NOT, &&op_UNKNOWN /* OP_AND */, &&op_UNKNOWN /* OP_OR */,
+            &&op_ADD_NUM, &&op_SUBTRACT_NUM, &&op_MULTIPLY_NUM, &&op_DIVIDE_NUM,
+            &&op_NEGATE_UNCHECKED, &&op_ADD_UNCHECKED, &&op_SUBTRACT_UNCHECKED,
+            &&op_MULTIPLY_UNCHECKED, &&op_DIVIDE_UNCHECKED,
+            &&op_MODULO_UNCHECKED, &&op_POWER_UNCHECKED,
+            &&op_GREATER_UNCHECKED, &&op_GREATER_EQUAL_UNCHECKED,
+            &&op_LESS_UNCHECKED, &&op_LESS_EQUAL_UNCHECKED,
+        };
+        static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT,
+                      "dispatchTable is out of sync with OpCode");
+
+        #define DISPATCH() do{ \
+            INSTRUMENT_INSTRUCTION(); \
+            instruction = READ_OPCODE(); \
+            if (instruction >= OP_COUNT) goto op_UNKNOWN; \
+            goto *dispatchTable[instruction]; \
+        } while(false)
+        #define INTERPRET_LOOP DISPATCH();
+        #define CASE(name) op_##name
+        #define DEFAULT op_UNKNOWN
+    #else
+        #define DISPATCH() goto loop
+        #define INTERPRET_LOOP \
+            loop: \
+            INSTRUMENT_INSTRUCTION(); \
+            switch (instruction = READ_OPCODE())
+        #define CASE(name) case OP_##name
+        #define DEFAULT default
+    #endif
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(CONSTANT):     {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(CONSTANT_BIG): {
+            uint32_t idx  = (uint32_t)READ_BYTE() << 16;
+                     idx |= (uint32_t)READ_BYTE() << 8;
+                     idx |= (uint32_t)READ_BYTE();
+            Value constant = vm->chunk->constants.values[idx];
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(INT8):         {
+            PUSH(NUMBER_VAL((double)(int8_t)READ_BYTE()));
+            DISPATCH();
+        }
+        CASE(INT16):        {
+            PUSH(NUMBER_VAL((double)READ_INT16()));
+            DISPATCH();
+        }
+        CASE(FIXED16):      {
+            PUSH(NUMBER_VAL(READ_INT16() / 256.0));
+            DISPATCH();
+        }
+        CASE(ADD):          {QUICKENING_OP(OP_ADD_NUM, NUMBER_VAL, +);      DISPATCH();}
+        CASE(SUBTRACT):     {QUICKENING_OP(OP_SUBTRACT_NUM, NUMBER_VAL, -); DISPATCH();}
+        CASE(MULTIPLY):     {QUICKENING_OP(OP_MULTIPLY_NUM, NUMBER_VAL, *); DISPATCH();}
+        CASE(DIVIDE):       {QUICKENING_OP(OP_DIVIDE_NUM, NUMBER_VAL, /);   DISPATCH();}
+        CASE(ADD_NUM):      {QUICKENED_OP(OP_ADD, NUMBER_VAL, +);           DISPATCH();}
+        CASE(SUBTRACT_NUM): {QUICKENED_OP(OP_SUBTRACT, NUMBER_VAL, -);      DISPATCH();}
+        CASE(MULTIPLY_NUM): {QUICKENED_OP(OP_MULTIPLY, NUMBER_VAL, *);      DISPATCH();}
+        CASE(DIVIDE_NUM):   {QUICKENED_OP(OP_DIVIDE, NUMBER_VAL, /);        DISPATCH();}
+        CASE(ADD_UNCHECKED):          {UNCHECKED_OP(NUMBER_VAL, +);  DISPATCH();}
+        CASE(SUBTRACT_UNCHECKED):     {UNCHECKED_OP(NUMBER_VAL, -);  DISPATCH();}
+        CASE(MULTIPLY_UNCHECKED):     {UNCHECKED_OP(NUMBER_VAL, *);  DISPATCH();}
+        CASE(DIVIDE_UNCHECKED):       {UNCHECKED_OP(NUMBER_VAL, /);  DISPATCH();}
+        CASE(MODULO_UNCHECKED):       {UNCHECKED_FN(NUMBER_VAL, fmod); DISPATCH();}
+        CASE(POWER_UNCHECKED):        {UNCHECKED_FN(NUMBER_VAL, pow);  DISPATCH();}
+        CASE(GREATER_UNCHECKED):      {UNCHECKED_OP(BOOL_VAL, >);    DISPATCH();}
+        CASE(GREATER_EQUAL_UNCHECKED):{UNCHECKED_OP(BOOL_VAL, >=);   DISPATCH();}
+        CASE(LESS_UNCHECKED):         {UNCHECKED_OP(BOOL_VAL, <);    DISPATCH();}
+        CASE(LESS_EQUAL_UNCHECKED):   {UNCHECKED_OP(BOOL_VAL, <=);   DISPATCH();}
+        CASE(NEGATE_UNCHECKED):       {
+            *(stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(stackTop - 1)));
+            DISPATCH();
+        }
+        CASE(MODULO):       {BINARY_FN(NUMBER_VAL, fmod); DISPATCH();}
+        CASE(POWER):        {BINARY_FN(NUMBER_VAL, pow);  DISPATCH();}
+        CASE(GREATER):      {BINARY_OP(BOOL_VAL, >);    DISPATCH();}
+        CASE(GREATER_EQUAL):{BINARY_OP(BOOL_VAL, >=);   DISPATCH();}
+        CASE(LESS):         {BINARY_OP(BOOL_VAL, <);    DISPATCH();}
+        CASE(LESS_EQUAL):   {BINARY_OP(BOOL_VAL, <=);   DISPATCH();}
+        CASE(EQUAL):        {
+            Value b = POP();
+            *(stackTop - 1) = BOOL_VAL(valuesEqual(*(stackTop - 1), b));
+            DISPATCH();
+        }
+        CASE(NOT_EQUAL):    {
+            Value b = POP();
+            *(stackTop - 1) = BOOL_VAL(!valuesEqual(*(stackTop - 1), b));
+            DISPATCH();
+        }
+        CASE(NOT):          {
+            *(stackTop - 1) = BOOL_VAL(isFalsey(*(stackTop - 1)));
+            DISPATCH();
+        }
+        CASE(NEGATE):       {
+            if(!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_NULL:         {
-                push(NULL_VAL);
-                break;
+            *(stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(stackTop - 1)));
+            DISPATCH();
+        }
+        CASE(RETURN):       {
+            if constexpr (MODE == RUN_PROFILE) endProfiledInstruction(profile, readTicks());
+            *result = POP();
+            vm->ip = ip;
+            vm->stackTop = stackTop;
+            return INTERPRET_OK;
+        }
+        CASE(TRUE):         {
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        }
+        CASE(FALSE):        {
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        }
+        CASE(NULL):         {
+            PUSH(NULL_VAL);
+            DISPATCH();
+        }
+        CASE(COLUMN):       {
+            uint8_t index = READ_BYTE();
+            if (index >= vm->columnCount) {
+                RUNTIME_ERROR("Column $%d is not bound.", index);
             }
+            PUSH(vm->columns[index]);
+            DISPATCH();
+        }
+        DEFAULT:            {
+            RUNTIME_ERROR("Unknown opcode %d.", instruction);
         }
     }
 
+    return INTERPRET_RUNTIME_ERROR;
+
     #undef READ_BYTE
+    #undef READ_OPCODE
     #undef READ_CONSTANT
+    #undef READ_INT16
+    #undef PEEK
+    #undef POP
+    #undef PUSH
+    #undef RUNTIME_ERROR
     #undef BINARY_OP
-    #undef POWER_RAISE
+    #undef BINARY_FN
+    #undef QUICKEN
+    #undef QUICKENING_OP
+    #undef QUICKENED_OP
+    #undef UNCHECKED_OP
+    #undef UNCHECKED_FN
+    #undef INSTRUMENT_INSTRUCTION
+    #undef DISPATCH
+    #undef INTERPRET_LOOP
+    #undef CASE
+    #undef DEFAULT
+}
+
+Program* prepare(VM* vm, const char* source, size_t length) {
+    vm->memory.exhausted = false;
+    MemoryAccount* previousAccount = useMemoryAccount(&vm->memory);
+    Program* program = ALLOCATE(MEMORY_OTHER, Program, 1);
+    if (program == nullptr) {
+        useMemoryAccount(previousAccount);
+        reportOutOfMemory(vm);
+        return nullptr;
+    }
+    initChunk(&program->chunk);
+    program->native = nullptr;
+    initArena(&program->arena);
+    program->account = &vm->memory;
+    Allocator* previous = useAllocator(&program->arena.allocator);
+
+    bool compiled = vm->compileThreads > 1 ? compileParallel(source, length, &program->chunk, vm->compileThreads)
+                                           : compile(source, length, &program->chunk);
+    // a chunk that lost bytes to running out of memory is no good even
+    // if it happened to parse
+    if (!compiled || vm->memory.exhausted) {
+        useAllocator(previous);
+        useMemoryAccount(previousAccount);
+        freeProgram(program);
+        if (vm->memory.exhausted) reportOutOfMemory(vm);
+        return nullptr;
+    }
+
+    if (vm->printCode) disassembleChunk(&program->chunk, "code");
+
+    if (vm->optimize) {
+        OptimizerStats stats;
+        optimizeChunk(&program->chunk, &stats);
+        if (vm->printOptimizerStats) {
+            fprintf(stderr, "[optimizer] instructions %d -> %d, constants %d -> %d\n",
+                    stats.instructionsBefore, stats.instructionsAfter,
+                    stats.constantsBefore, stats.constantsAfter);
+        }
+        if (vm->printCode) disassembleChunk(&program->chunk, "optimized");
+    }
+
+    if (vm->jit && !vm->memory.exhausted) program->native = compileNative(&program->chunk);
+
+    useAllocator(previous);
+    useMemoryAccount(previousAccount);
+    if (vm->memory.exhausted) {
+        freeProgram(program);
+        reportOutOfMemory(vm);
+        return nullptr;
+    }
+    if (vm->printArenaStats) {
+        const ArenaStats* stats = &program->arena.stats;
+        fprintf(stderr, "[arena] %zu allocations, %zu bytes, %zu bytes reserved in %d blocks\n",
+                stats->allocations, stats->bytes, stats->reservedBytes, stats->blocks);
+    }
+    return program;
+}
+
+InterpretResult execute(VM* vm, const Program* program, Value* result) {
+    vm->chunk = &program->chunk;
+    vm->ip = vm->chunk->code;
+    if (!reserveStack(vm, vm->chunk)) return INTERPRET_RUNTIME_ERROR;
+    resetStack(vm);
+
+    if (!vm->traceExecution && vm->profile != nullptr) {
+        // native code would run uncounted, so it is skipped
+        profileChunk(vm->profile, vm->chunk);
+        return run<RUN_PROFILE>(vm, result, nullptr, vm->profile, nullptr);
+    }
+    if (!vm->traceExecution && vm->sampler != nullptr) {
+        bool sampling = startSampling(vm->sampler, vm->chunk);
+        InterpretResult status = run<RUN_SAMPLE>(vm, result, nullptr, nullptr, vm->sampler);
+        if (sampling) stopSampling(vm->sampler);
+        return status;
+    }
+    if (!vm->traceExecution) {
+        // native code runs as far as it can, run() finishes from there
+        if (program->native != nullptr) {
+            vm->ip = vm->chunk->code + runNative(program->native, &vm->stackTop);
+        }
+        return run<RUN_PLAIN>(vm, result, nullptr, nullptr, nullptr);
+    }
+
+    MemoryAccount* previous = useMemoryAccount(&vm->memory);
+    TraceSink* sink = ALLOCATE(MEMORY_OTHER, TraceSink, 1);
+    useMemoryAccount(previous);
+    if (sink == nullptr) {
+        reportOutOfMemory(vm);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    initTraceSink(sink, stdout);
+    InterpretResult status = run<RUN_TRACE>(vm, result, sink, nullptr, nullptr);
+    flushTraceSink(sink);
+    previous = useMemoryAccount(&vm->memory);
+    FREE(MEMORY_OTHER, TraceSink, sink);
+    useMemoryAccount(previous);
+    return status;
 }
 
-InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    initChunk(&chunk);
+void freeProgram(Program* program) {
+    MemoryAccount* previousAccount = useMemoryAccount(program->account);
+    Allocator* previous = useAllocator(&program->arena.allocator);
+    freeChunk(&program->chunk);
+    freeNative(program->native);
+    useAllocator(previous);
+    freeArena(&program->arena);
+    FREE(MEMORY_OTHER, Program, program);
+    useMemoryAccount(previousAccount);
+}
 
-    if(!compile(source, &chunk)){
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+InterpretResult interpretProgram(VM* vm, const Program* program) {
+    Value value;
+    InterpretResult result = execute(vm, program, &value);
+    if (result == INTERPRET_OK) {
+        printValue(value);
+        printf("\n");
     }
+    return result;
+}
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+InterpretResult interpret(VM* vm, const char* source) {
+    Program* program = prepare(vm, source, strlen(source));
+    if (program == nullptr) return vm->memory.exhausted ? INTERPRET_RUNTIME_ERROR : INTERPRET_COMPILE_ERROR;
 
-    InterpretResult result = run();
+    InterpretResult result = interpretProgram(vm, program);
 
-    freeChunk(&chunk);
+    freeProgram(program);
     return result;
 }
\ No newline at end of file
@@ -1,13 +1,44 @@
 #pragma once
 
 #include "chunk.hpp"
+#include "jit.hpp"
+#include "memory.hpp"
+#include "profiler.hpp"
+// the most stack slots a single program may ask for
 #define STACK_MAX 1024
 
 struct VM{
-    Chunk* chunk;
+    const Chunk* chunk;
     uint8_t* ip;
-    Value stack[STACK_MAX];
+    // grown on demand to the largest Chunk::maxStack executed so far
+    Value* stack;
+    int stackCapacity;
     Value* stackTop;
+    // values of $0 .. $(columnCount - 1) for the row being evaluated
+    const Value* columns;
+    int columnCount;
+    // run optimizeChunk() between compile() and run()
+    bool optimize;
+    bool printOptimizerStats;
+    // print how much prepare() allocated from the program's arena
+    bool printArenaStats;
+    // print every instruction and the stack as it runs (slow, separate loop)
+    bool traceExecution;
+    // if set, count and time every instruction into it (separate loop,
+    // native code is not used); ignored while tracing
+    Profile* profile;
+    // if set, sample the running instruction into it on a SIGPROF timer
+    // (separate loop, native code is not used); ignored while tracing or
+    // profiling
+    Sampler* sampler;
+    // disassemble chunks after compiling and optimizing them
+    bool printCode;
+    // translate prepared programs to native code where the JIT supports it
+    bool jit;
+    // scan sources on this many threads before compiling them
+    int compileThreads;
+    // everything this VM allocates: its stack and the programs it prepares
+    MemoryAccount memory;
 };
 
 enum InterpretResult{
@@ -16,8 +47,37 @@ enum InterpretResult{
     INTERPRET_RUNTIME_ERROR
 };
 
-void initVM();
-void freeVM(); 
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
\ No newline at end of file
+// A compiled (and, if enabled, optimized) script. Once prepare() returns,
+// the same Program can be executed any number of times without scanning,
+// compiling or allocating, including from several VMs on different
+// threads at once. The one thing run() still writes is an opcode byte,
+// when quickening swaps an arithmetic opcode for its number-only variant
+// or back; threads race on those bytes, so every opcode is stored and
+// loaded with loadOpcode()/storeOpcode() rather than plain byte accesses.
+struct Program{
+    Chunk chunk;
+    // native translation of chunk, or nullptr to only interpret it
+    NativeCode* native;
+    // holds everything prepare() allocated, released by freeProgram()
+    Arena arena;
+    // the VM's account the program's memory is charged to, so it must be
+    // freed before that VM is
+    MemoryAccount* account;
+};
+
+// All interpreter state lives in the VM passed in, so separate VMs can run
+// concurrently on separate threads without any locking.
+void initVM(VM* vm);
+void freeVM(VM* vm); 
+// interpret() takes a NUL-terminated string, prepare() `length` bytes
+// that need no terminator and are no longer used once it returns.
+InterpretResult interpret(VM* vm, const char* source);
+Program* prepare(VM* vm, const char* source, size_t length);
+InterpretResult execute(VM* vm, const Program* program, Value* result);
+// execute() and print the result, as interpret() does
+InterpretResult interpretProgram(VM* vm, const Program* program);
+void freeProgram(Program* program);
+// The caller makes room first: the stack is sized for the chunk's
+// maxStack before a run, and push() does not check again.
+void push(VM* vm, Value value);
+Value pop(VM* vm);
\ No newline at end of file